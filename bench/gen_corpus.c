@@ -0,0 +1,92 @@
+// Writes the source of a program with many LOG callsites of mixed argument types.
+// The generated program writes a log with a given number of records, it is the input of the decoder benchmark.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *STRINGS[] = {"", "ok", "connection reset by peer", "GET /index.html", "a somewhat longer string argument"};
+constexpr int STRING_COUNT = sizeof STRINGS / sizeof STRINGS[0];
+constexpr int TYPE_KINDS = 5;
+
+static void write_arg(FILE *f, int kind, int callsite, int arg) {
+    switch (kind) {
+        case 0: fprintf(f, "(uint8_t)(i + %d)", arg); break;
+        case 1: fprintf(f, "(uint32_t)(i * %du)", callsite % 97 + 1); break;
+        case 2: fprintf(f, "(int32_t)(i %% 2000) - %d", 1000 + arg); break;
+        case 3: fprintf(f, "(float)i * %d.25f", arg + 1); break;
+        case 4: fprintf(f, "STRINGS[(i + %d) %% %d]", callsite, STRING_COUNT); break;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s callsite_count output.c\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int callsite_count = atoi(argv[1]);
+    FILE *f = fopen(argv[2], "w");
+    if (callsite_count <= 0 || f == nullptr) return EXIT_FAILURE;
+
+    fputs("// Generated by gen_corpus, do not edit\n", f);
+    fputs("#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include \"csl.h\"\n\n", f);
+    fputs("static csl_logger_t *LOGGER;\n", f);
+    fputs("static const char *STRINGS[] = {", f);
+    for (int i = 0; i < STRING_COUNT; ++i) fprintf(f, "%s\"%s\"", i == 0 ? "" : ", ", STRINGS[i]);
+    fputs("};\n\n", f);
+
+    // A simple LCG picks the argument count and types, so the same callsite_count always gives the same program
+    uint32_t state = 12345;
+    for (int c = 0; c < callsite_count; ++c) {
+        state = state * 1103515245u + 12345u;
+        int arg_count = (int)(state >> 16) % 5;
+
+        int kinds[4];
+        for (int a = 0; a < arg_count; ++a) {
+            state = state * 1103515245u + 12345u;
+            kinds[a] = (int)(state >> 16) % TYPE_KINDS;
+        }
+
+        fprintf(f, "static void callsite_%d(uint32_t i) {\n    (void)i;\n", c);
+        fprintf(f, "    LOG_TO(LOGGER, \"callsite %d", c);
+        for (int a = 0; a < arg_count; ++a) fputs(" {}", f);
+        fprintf(f, "\", LL_INFO");
+        for (int a = 0; a < arg_count; ++a) {
+            fputs(", ", f);
+            write_arg(f, kinds[a], c, a);
+        }
+        fputs(");\n}\n\n", f);
+    }
+
+    fputs("static void (*const CALLSITES[])(uint32_t) = {\n", f);
+    for (int c = 0; c < callsite_count; ++c) fprintf(f, "    callsite_%d,\n", c);
+    fputs("};\n\n", f);
+
+    fputs(
+        "int main(int argc, char **argv) {\n"
+        "    if (argc < 3) {\n"
+        "        printf(\"Usage: %s record_count log_file [--compact]\\n\", argv[0]);\n"
+        "        return EXIT_FAILURE;\n"
+        "    }\n"
+        "    uint64_t record_count = strtoull(argv[1], nullptr, 10);\n"
+        "    bool compact = argc > 3 && strcmp(argv[3], \"--compact\") == 0;\n"
+        "\n"
+        "    LOGGER = csl_logger_open(argv[2], &(LoggerConfig) {.level = LL_INFO, .flush_level = LL_FATAL, .compact = compact});\n"
+        "    if (LOGGER == nullptr) return EXIT_FAILURE;\n"
+        "\n"
+        "    uint32_t state = 1;\n"
+        "    constexpr size_t CALLSITE_COUNT = sizeof CALLSITES / sizeof CALLSITES[0];\n"
+        "    for (uint64_t i = 0; i < record_count; ++i) {\n"
+        "        state ^= state << 13;\n"
+        "        state ^= state >> 17;\n"
+        "        state ^= state << 5;\n"
+        "        CALLSITES[state % CALLSITE_COUNT]((uint32_t)i);\n"
+        "    }\n"
+        "\n"
+        "    csl_logger_close(LOGGER);\n"
+        "    return EXIT_SUCCESS;\n"
+        "}\n", f);
+
+    fclose(f);
+    return EXIT_SUCCESS;
+}
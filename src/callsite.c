@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <link.h>
+
+#include "csl_internal.h"
+
+typedef enum: uint8_t {
+    RULE_ON,
+    RULE_OFF,
+    RULE_DEFAULT,
+} RuleAction;
+
+typedef struct {
+    RuleAction action;
+    char *file;
+    char *function;
+    int line;
+    bool has_id;
+    int64_t id;
+} ControlRule;
+
+// A loaded image (the program, a shared library or a plugin) with registered callsites
+typedef struct {
+    uintptr_t base;
+    // Address range of its loadable segments
+    uintptr_t start;
+    uintptr_t end;
+    int32_t key;
+    char build_id[32];
+} Module;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    size_t size;
+    size_t capacity;
+    LogHeader **headers;
+
+    size_t rule_count;
+    ControlRule *rules;
+
+    // In the order their first callsite was registered, CSL_MODULE_COUNT holds their number. An unloaded image keeps
+    // its entry for the module records but gets an empty address range.
+    size_t module_capacity;
+    Module *modules;
+    // dlpi_subs when the registry last dropped the images unloaded with dlclose
+    unsigned long long image_unloads;
+
+    // Number of open loggers per level, a callsite below the lowest of them can't be logged
+    size_t logger_levels[LL_COUNT];
+
+    char *watch_path;
+} CallsiteRegistry;
+
+static CallsiteRegistry REGISTRY = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint32_t CSL_MODULE_COUNT = 0;
+
+typedef struct {
+    uintptr_t address;
+    Module module;
+    size_t build_id_size;
+} ModuleSearch;
+
+// Copies the GNU build id from a PT_NOTE segment and returns its size, 0 if the segment has none
+static size_t read_build_id(const struct dl_phdr_info *info, const ElfW(Phdr) *phdr, char *build_id) {
+    const char *p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+    const char *end = p + phdr->p_memsz;
+
+    while (p + sizeof(ElfW(Nhdr)) <= end) {
+        const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)p;
+        const char *name = p + sizeof *note;
+        const char *desc = name + ((note->n_namesz + 3) & ~3u);
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+            size_t size = note->n_descsz < 32 ? note->n_descsz : 32;
+            memcpy(build_id, desc, size);
+            return size;
+        }
+        p = desc + ((note->n_descsz + 3) & ~3u);
+    }
+    return 0;
+}
+
+static size_t image_build_id(const struct dl_phdr_info *info, char *build_id) {
+    for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+        if (info->dlpi_phdr[i].p_type != PT_NOTE) continue;
+        size_t size = read_build_id(info, &info->dlpi_phdr[i], build_id);
+        if (size > 0) return size;
+    }
+    return 0;
+}
+
+// Address range of the loadable segments of an image
+static void image_range(const struct dl_phdr_info *info, uintptr_t *start, uintptr_t *end) {
+    *start = UINTPTR_MAX;
+    *end = 0;
+    for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD) continue;
+        uintptr_t segment_start = info->dlpi_addr + phdr->p_vaddr;
+        if (segment_start < *start) *start = segment_start;
+        if (segment_start + phdr->p_memsz > *end) *end = segment_start + phdr->p_memsz;
+    }
+}
+
+static int find_module(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    ModuleSearch *search = data;
+
+    uintptr_t start;
+    uintptr_t end;
+    image_range(info, &start, &end);
+    if (search->address < start || search->address >= end) return 0;
+
+    search->module = (Module) {.base = info->dlpi_addr, .start = start, .end = end};
+    search->build_id_size = image_build_id(info, search->module.build_id);
+    search->module.key = csl_module_key(search->module.build_id, search->build_id_size);
+    return 1;
+}
+
+static LogLevel lowest_logger_level() {
+    for (int i = 0; i < LL_COUNT; ++i) {
+        if (REGISTRY.logger_levels[i] > 0) return i;
+    }
+    return LL_COUNT;
+}
+
+static bool rule_matches(const ControlRule *rule, const LogHeader *header) {
+    if (rule->file != nullptr && fnmatch(rule->file, header->filename.data, 0) != 0) return false;
+    if (rule->function != nullptr && fnmatch(rule->function, header->function.data, 0) != 0) return false;
+    if (rule->line >= 0 && rule->line != header->line) return false;
+    if (rule->has_id && rule->id != header->id) return false;
+    return true;
+}
+
+static CallsiteState callsite_evaluate(const LogHeader *header) {
+    RuleAction action = RULE_DEFAULT;
+    for (size_t i = 0; i < REGISTRY.rule_count; ++i) {
+        if (rule_matches(&REGISTRY.rules[i], header)) action = REGISTRY.rules[i].action;
+    }
+
+    switch (action) {
+        case RULE_ON:
+            return CSL_CALLSITE_FORCED;
+        case RULE_OFF:
+            return CSL_CALLSITE_DISABLED;
+        case RULE_DEFAULT:
+            return header->level >= lowest_logger_level() ? CSL_CALLSITE_ENABLED : CSL_CALLSITE_DISABLED;
+    }
+    unreachable();
+}
+
+typedef struct {
+    bool evaluate;
+    // Per module and per header, set for the ones of images that are still loaded
+    bool *loaded;
+    bool *kept;
+    unsigned long long unloads;
+} ImageSync;
+
+// Needs the lock. The loader holds its own lock during the callback, so the image can't be unloaded while the
+// states of its headers are written.
+static int sync_image(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    ImageSync *sync = data;
+    sync->unloads = info->dlpi_subs;
+
+    uintptr_t start;
+    uintptr_t end;
+    image_range(info, &start, &end);
+    char build_id[32] = {};
+    bool has_build_id = false;
+
+    for (size_t i = 0; i < CSL_MODULE_COUNT; ++i) {
+        const Module *module = &REGISTRY.modules[i];
+        if (module->base != info->dlpi_addr || module->start != start || module->end != end) continue;
+        // Another image can be mapped where an unloaded one was
+        if (!has_build_id) {
+            image_build_id(info, build_id);
+            has_build_id = true;
+        }
+        if (memcmp(module->build_id, build_id, sizeof build_id) != 0) continue;
+        sync->loaded[i] = true;
+
+        for (size_t j = 0; j < REGISTRY.size; ++j) {
+            LogHeader *h = REGISTRY.headers[j];
+            if ((uintptr_t)h < start || (uintptr_t)h >= end) continue;
+            sync->kept[j] = true;
+            if (sync->evaluate) __atomic_store_n(&h->state, callsite_evaluate(h), __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+// Needs the lock, forgets the images unloaded with dlclose and their headers, evaluate also updates the states of
+// the remaining headers
+static void registry_sync_images(bool evaluate) {
+    ImageSync sync = {
+        .evaluate = evaluate,
+        .loaded = calloc(CSL_MODULE_COUNT + 1, sizeof(bool)),
+        .kept = calloc(REGISTRY.size + 1, sizeof(bool)),
+    };
+    if (sync.loaded == nullptr || sync.kept == nullptr) {
+        free(sync.loaded);
+        free(sync.kept);
+        return;
+    }
+    dl_iterate_phdr(sync_image, &sync);
+    REGISTRY.image_unloads = sync.unloads;
+
+    for (size_t i = 0; i < CSL_MODULE_COUNT; ++i) {
+        if (!sync.loaded[i]) REGISTRY.modules[i].start = REGISTRY.modules[i].end = 0;
+    }
+    size_t kept_count = 0;
+    for (size_t i = 0; i < REGISTRY.size; ++i) {
+        if (sync.kept[i]) REGISTRY.headers[kept_count++] = REGISTRY.headers[i];
+    }
+    REGISTRY.size = kept_count;
+
+    free(sync.loaded);
+    free(sync.kept);
+}
+
+static int read_image_unloads(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    *(unsigned long long *)data = info->dlpi_subs;
+    return 1;
+}
+
+size_t callsite_image_build_id(const void *address, char *build_id) {
+    ModuleSearch search = {.address = (uintptr_t)address};
+    dl_iterate_phdr(find_module, &search);
+    memcpy(build_id, search.module.build_id, sizeof search.module.build_id);
+    return search.build_id_size;
+}
+
+// Needs the lock, an image is added when its first callsite is registered, nullptr if no image contains address
+static const Module *module_of(uintptr_t address) {
+    // The range of an unloaded image can belong to a new one by now
+    unsigned long long unloads = 0;
+    dl_iterate_phdr(read_image_unloads, &unloads);
+    if (unloads != REGISTRY.image_unloads) registry_sync_images(false);
+
+    for (size_t i = 0; i < CSL_MODULE_COUNT; ++i) {
+        const Module *module = &REGISTRY.modules[i];
+        if (address >= module->start && address < module->end) return module;
+    }
+
+    ModuleSearch search = {.address = address};
+    if (dl_iterate_phdr(find_module, &search) == 0) return nullptr;
+
+    if (CSL_MODULE_COUNT == REGISTRY.module_capacity) {
+        size_t capacity = REGISTRY.module_capacity == 0 ? 8 : REGISTRY.module_capacity * 2;
+        Module *modules = realloc(REGISTRY.modules, capacity * sizeof(modules[0]));
+        if (modules == nullptr) return nullptr;
+        REGISTRY.modules = modules;
+        REGISTRY.module_capacity = capacity;
+    }
+    REGISTRY.modules[CSL_MODULE_COUNT] = search.module;
+    // Loggers compare the count without the lock and write the module records of new images
+    __atomic_store_n(&CSL_MODULE_COUNT, CSL_MODULE_COUNT + 1, __ATOMIC_RELEASE);
+    return &REGISTRY.modules[CSL_MODULE_COUNT - 1];
+}
+
+// Needs the lock
+static int64_t callsite_compute_id(const LogHeader *header) {
+    uintptr_t address = (uintptr_t)header;
+    const Module *module = module_of(address);
+    uintptr_t base = module != nullptr ? module->base : 0;
+    return csl_callsite_id_make(module != nullptr ? module->key : 0,
+                                (uint32_t)((address - base) / alignof(LogHeader)));
+}
+
+int64_t csl_callsite_id(LogHeader *header) {
+    pthread_mutex_lock(&REGISTRY.lock);
+    if (header->id == 0) __atomic_store_n(&header->id, callsite_compute_id(header), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&REGISTRY.lock);
+    return header->id;
+}
+
+char *callsite_encode_module(char *p, uint32_t index) {
+    pthread_mutex_lock(&REGISTRY.lock);
+    const Module *module = &REGISTRY.modules[index];
+    p = encode_binary_i32(p, module->key);
+    p = encode_binary_u64(p, module->base);
+    memcpy(p, module->build_id, sizeof module->build_id);
+    pthread_mutex_unlock(&REGISTRY.lock);
+    return p + sizeof module->build_id;
+}
+
+// Needs the lock, the headers of unloaded plugins are dropped on the way
+static void callsite_reevaluate_all() {
+    registry_sync_images(true);
+}
+
+CallsiteState callsite_register(LogHeader *header) {
+    pthread_mutex_lock(&REGISTRY.lock);
+
+    CallsiteState state = __atomic_load_n(&header->state, __ATOMIC_RELAXED);
+    if (state == CSL_CALLSITE_NEW) {
+        // Id rules need the id, it is also cached for the loggers here. It is computed before the header is added,
+        // finding the module can drop the headers of unloaded images.
+        if (header->id == 0) __atomic_store_n(&header->id, callsite_compute_id(header), __ATOMIC_RELAXED);
+
+        if (REGISTRY.size == REGISTRY.capacity) {
+            size_t capacity = REGISTRY.capacity == 0 ? 64 : REGISTRY.capacity * 2;
+            LogHeader **headers = realloc(REGISTRY.headers, capacity * sizeof(headers[0]));
+            if (headers == nullptr) {
+                pthread_mutex_unlock(&REGISTRY.lock);
+                return CSL_CALLSITE_ENABLED;
+            }
+            REGISTRY.headers = headers;
+            REGISTRY.capacity = capacity;
+        }
+        REGISTRY.headers[REGISTRY.size++] = header;
+        state = callsite_evaluate(header);
+        __atomic_store_n(&header->state, state, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&REGISTRY.lock);
+    return state;
+}
+
+void callsite_track_level(LogLevel old_level, LogLevel new_level) {
+    pthread_mutex_lock(&REGISTRY.lock);
+
+    LogLevel lowest = lowest_logger_level();
+    if (old_level < LL_COUNT) REGISTRY.logger_levels[old_level] -= 1;
+    if (new_level < LL_COUNT) REGISTRY.logger_levels[new_level] += 1;
+
+    if (lowest != lowest_logger_level()) callsite_reevaluate_all();
+
+    pthread_mutex_unlock(&REGISTRY.lock);
+}
+
+static void free_rules(ControlRule *rules, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        free(rules[i].file);
+        free(rules[i].function);
+    }
+    free(rules);
+}
+
+static bool parse_rule(char *line, ControlRule *rule) {
+    *rule = (ControlRule) {.line = -1};
+
+    char *save = nullptr;
+    char *word = strtok_r(line, " \t", &save);
+
+    if (strcmp(word, "on") == 0)            rule->action = RULE_ON;
+    else if (strcmp(word, "off") == 0)      rule->action = RULE_OFF;
+    else if (strcmp(word, "default") == 0)  rule->action = RULE_DEFAULT;
+    else return false;
+
+    while ((word = strtok_r(nullptr, " \t", &save)) != nullptr) {
+        char *value = strchr(word, '=');
+        if (value == nullptr) return false;
+        *value++ = '\0';
+
+        char *end;
+        if (strcmp(word, "file") == 0) {
+            free(rule->file);
+            rule->file = strdup(value);
+        } else if (strcmp(word, "function") == 0) {
+            free(rule->function);
+            rule->function = strdup(value);
+        } else if (strcmp(word, "line") == 0) {
+            rule->line = (int)strtol(value, &end, 10);
+            if (*end != '\0') return false;
+        } else if (strcmp(word, "id") == 0) {
+            rule->has_id = true;
+            rule->id = strtoll(value, &end, 10);
+            if (*end != '\0') return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int csl_control_apply(const char *rules) {
+    char *text = strdup(rules);
+    if (text == nullptr) return -1;
+
+    size_t count = 0;
+    ControlRule *parsed = nullptr;
+
+    char *save = nullptr;
+    for (char *line = strtok_r(text, "\n", &save); line != nullptr; line = strtok_r(nullptr, "\n", &save)) {
+        line += strspn(line, " \t\r");
+        line[strcspn(line, "#\r")] = '\0';
+        if (line[0] == '\0') continue;
+
+        ControlRule *new_parsed = realloc(parsed, (count + 1) * sizeof(parsed[0]));
+        if (new_parsed == nullptr) {
+            free_rules(parsed, count);
+            free(text);
+            return -1;
+        }
+        parsed = new_parsed;
+
+        bool ok = parse_rule(line, &parsed[count]);
+        count += 1;
+        if (!ok) {
+            free_rules(parsed, count);
+            free(text);
+            return -1;
+        }
+    }
+    free(text);
+
+    pthread_mutex_lock(&REGISTRY.lock);
+    free_rules(REGISTRY.rules, REGISTRY.rule_count);
+    REGISTRY.rules = parsed;
+    REGISTRY.rule_count = count;
+    callsite_reevaluate_all();
+    pthread_mutex_unlock(&REGISTRY.lock);
+
+    return (int)count;
+}
+
+int csl_control_load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) return -1;
+
+    char *text = nullptr;
+    size_t size = 0;
+    FILE *content = open_memstream(&text, &size);
+    if (content == nullptr) {
+        fclose(f);
+        return -1;
+    }
+
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof buffer, f)) > 0) {
+        fwrite(buffer, 1, read, content);
+    }
+    fclose(f);
+    fclose(content);
+
+    int result = csl_control_apply(text);
+    free(text);
+    return result;
+}
+
+// Runs on the signal thread
+static void control_reload(int signo) {
+    (void)signo;
+
+    // A copy, csl_control_watch may replace the path while the rules are loaded
+    pthread_mutex_lock(&REGISTRY.lock);
+    char *path = REGISTRY.watch_path != nullptr ? strdup(REGISTRY.watch_path) : nullptr;
+    pthread_mutex_unlock(&REGISTRY.lock);
+
+    if (path != nullptr) csl_control_load(path);
+    free(path);
+}
+
+void csl_control_watch(const char *path, int signo) {
+    char *copy = strdup(path);
+    pthread_mutex_lock(&REGISTRY.lock);
+    free(REGISTRY.watch_path);
+    REGISTRY.watch_path = copy;
+    pthread_mutex_unlock(&REGISTRY.lock);
+
+    signal_thread_watch(signo, control_reload);
+}
+
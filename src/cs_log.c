@@ -1,20 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
-#include "csl.h"
-
-static LogHeader SentinelLogHeader = {
-        .MARKER = LOGGING_HEADER_MAGIC_NUMBER,
-        .category = '~',
-};
+#include "csl_internal.h"
 
 uint32_t get_current_time_ms() {
     struct timeval ts;
@@ -22,16 +20,64 @@ uint32_t get_current_time_ms() {
     return (uint32_t) (ts.tv_sec * 1000 + ts.tv_usec / 1000);
 }
 
-static inline int32_t get_logging_id(const LogHeader *header) {
-    // NOTE: maybe choose a bigger data type here, int32_t might not be able to hold every offset
-    if (header->id != 0) return header->id;
-    return (int32_t)((char*)header - (char*)&SentinelLogHeader);
+static inline int64_t get_logging_id(const LogHeader *header) {
+    // Cached when the callsite is registered, the header is always a static, writable object created by LOG_TO
+    int64_t id = __atomic_load_n(&header->id, __ATOMIC_RELAXED);
+    return id != 0 ? id : csl_callsite_id((LogHeader *)header);
 }
 
+// Dictionary index of every callsite in a compact stream, open addressing with the header address as key
+typedef struct {
+    size_t slot_count;
+    size_t size;
+    const LogHeader **headers;
+    uint32_t *indices;
+} CallsiteCodes;
+
+// The last written record of a coalescing logger and the repetitions of it that were only counted so far
 typedef struct {
-    FILE *logfile;
+    // Plain encoding of the record, everything but the timestamp is compared
+    char *record;
+    size_t size;
+    size_t capacity;
+    uint32_t timestamp;
+
+    uint32_t repeat_count;
+    uint32_t first_repeat;
+    uint32_t last_repeat;
+    // repeat_count > 0, read without the lock by messages that may end the run
+    bool run_open;
+} Coalescer;
+
+typedef struct Logger {
+    LoggerSink sink;
+    bool is_open;
+    // Serializes sinks that are not thread safe on their own
+    pthread_mutex_t lock;
+    union {
+        FILE *logfile;
+        ShmRing *ring;
+        UringWriter *uring;
+        AppendWriter *append;
+        FlightRecorder *flight;
+        SocketWriter *socket;
+    };
     LogLevel level;
+    // The dump level of a flight recorder, a flush is its dump
     LogLevel flush_level;
+
+    // Stream state of the compact encoding, records are encoded and written under encode_lock
+    bool compact;
+    pthread_mutex_t encode_lock;
+    uint32_t last_timestamp;
+    CallsiteCodes codes;
+
+    // Module records written so far, the images of new callsites are announced under encode_lock
+    uint32_t modules_written;
+
+    // Runs of repeated records are counted under encode_lock as well, 0 if coalescing is off
+    uint32_t coalesce_ms;
+    Coalescer coalescer;
 } Logger;
 
 static Logger GLOBAL_LOGGER = {
@@ -39,69 +85,698 @@ static Logger GLOBAL_LOGGER = {
     .flush_level = LL_INFO,
 };
 
-char build_id_end __attribute__((section(".note.gnu.build-id#"))) = '!';
+constexpr size_t RECORD_STACK_BUFFER_SIZE = 256;
+constexpr size_t DEFAULT_SHM_RING_SIZE = 4 << 20;
+constexpr size_t DEFAULT_URING_BUFFER_SIZE = 256 << 10;
+constexpr uint32_t DEFAULT_URING_BUFFER_COUNT = 8;
+constexpr size_t DEFAULT_APPEND_BUFFER_SIZE = 64 << 10;
+constexpr size_t DEFAULT_FLIGHT_RECORDER_SIZE = 16 << 20;
+constexpr size_t DEFAULT_SOCKET_BUFFER_SIZE = CSL_COLLECTOR_MAX_BATCH_SIZE;
+constexpr uint32_t DEFAULT_SOCKET_BUFFER_COUNT = 64;
 
-void csl_easy_init(const char *filename, LogLevel level) {
-    GLOBAL_LOGGER.logfile = fopen(filename, "wb");
-    write_binary_u32(LOGGING_FILE_HEADER_MAGIC_NUMBER,GLOBAL_LOGGER.logfile);
-    write_binary_u32(LOGGING_FILE_HEADER_VERSION_NUMBER,GLOBAL_LOGGER.logfile);
+static void sink_write(Logger *logger, const char *data, size_t byte_count) {
+    switch (logger->sink) {
+        case CSL_SINK_FILE:
+            // One fwrite per record keeps records of different threads from interleaving
+            fwrite(data, 1, byte_count, logger->logfile);
+            break;
+        case CSL_SINK_SHM:
+            pthread_mutex_lock(&logger->lock);
+            shm_ring_write(logger->ring, data, byte_count);
+            pthread_mutex_unlock(&logger->lock);
+            break;
+        case CSL_SINK_SHARED_FILE:
+            // Locks on its own, the lock is also taken around fork
+            append_writer_write(logger->append, data, byte_count);
+            break;
+        case CSL_SINK_FLIGHT_RECORDER:
+            pthread_mutex_lock(&logger->lock);
+            flight_recorder_write(logger->flight, data, byte_count);
+            pthread_mutex_unlock(&logger->lock);
+            break;
+        case CSL_SINK_SOCKET:
+            // Locks on its own, the lock is also taken around fork
+            socket_writer_write(logger->socket, data, byte_count);
+            break;
+        case CSL_SINK_IO_URING:
+#ifdef CSL_IO_URING_AVAILABLE
+            pthread_mutex_lock(&logger->lock);
+            uring_writer_write(logger->uring, data, byte_count);
+            pthread_mutex_unlock(&logger->lock);
+            break;
+#endif
+        case CSL_SINK_COUNT:
+            unreachable();
+    }
+}
+
+static void sink_flush(Logger *logger) {
+    switch (logger->sink) {
+        case CSL_SINK_FILE:
+            fflush(logger->logfile);
+            break;
+        case CSL_SINK_SHM:
+            break;
+        case CSL_SINK_SHARED_FILE:
+            append_writer_flush(logger->append);
+            break;
+        case CSL_SINK_FLIGHT_RECORDER:
+            // A flush is the trigger of the flight recorder, it writes the ring to the next numbered file
+            pthread_mutex_lock(&logger->lock);
+            flight_recorder_dump(logger->flight, nullptr);
+            pthread_mutex_unlock(&logger->lock);
+            break;
+        case CSL_SINK_SOCKET:
+            socket_writer_flush(logger->socket);
+            break;
+        case CSL_SINK_IO_URING:
+#ifdef CSL_IO_URING_AVAILABLE
+            pthread_mutex_lock(&logger->lock);
+            uring_writer_flush(logger->uring);
+            pthread_mutex_unlock(&logger->lock);
+            break;
+#endif
+        case CSL_SINK_COUNT:
+            unreachable();
+    }
+}
 
-    // Would be better to open own file here and parse build id similar to the log reader
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Warray-bounds"
-    fwrite(&build_id_end -20, 1, 20, GLOBAL_LOGGER.logfile);
-#pragma GCC diagnostic pop
-    // Pad build_id to 32 bytes
-    for (int i = 0; i < 12; ++i) {
-        write_binary_u8(0, GLOBAL_LOGGER.logfile);
+static void sink_close(Logger *logger) {
+    switch (logger->sink) {
+        case CSL_SINK_FILE:
+            fclose(logger->logfile);
+            logger->logfile = nullptr;
+            break;
+        case CSL_SINK_SHM:
+            shm_ring_close(logger->ring);
+            logger->ring = nullptr;
+            break;
+        case CSL_SINK_SHARED_FILE:
+            append_writer_close(logger->append);
+            logger->append = nullptr;
+            break;
+        case CSL_SINK_FLIGHT_RECORDER:
+            flight_recorder_close(logger->flight);
+            logger->flight = nullptr;
+            break;
+        case CSL_SINK_SOCKET:
+            socket_writer_close(logger->socket);
+            logger->socket = nullptr;
+            break;
+        case CSL_SINK_IO_URING:
+#ifdef CSL_IO_URING_AVAILABLE
+            uring_writer_close(logger->uring);
+            logger->uring = nullptr;
+            break;
+#endif
+        case CSL_SINK_COUNT:
+            unreachable();
     }
+}
+
+// Needs the encode_lock, writes the repeat record of the current run. forget starts over with the next record,
+// for a stream that does not keep the record the next repeat record would refer to.
+static void coalescer_end_run(Logger *logger, bool forget) {
+    Coalescer *c = &logger->coalescer;
+    if (forget) c->size = 0;
+    if (c->repeat_count == 0) return;
 
-    for (int i = 0; i < LOGGING_FILE_HEADER_RESERVED_COUNT; ++i) {
-        write_binary_u8(0, GLOBAL_LOGGER.logfile);
+    char record[5 + 5 + 5 + 5 + 5];
+    char *p = record;
+    if (logger->compact) {
+        p = encode_binary_varint_u32(p, CSL_COMPACT_CODE_NEW);
+        p = encode_binary_varint_i32(p, CSL_RECORD_REPEAT);
+        p = encode_binary_varint_u32(p, c->repeat_count);
+        p = encode_binary_varint_i32(p, (int32_t)(c->first_repeat - logger->last_timestamp));
+        p = encode_binary_varint_u32(p, c->last_repeat - c->first_repeat);
+        logger->last_timestamp = c->last_repeat;
+    } else {
+        p = encode_binary_i32(p, CSL_RECORD_REPEAT);
+        p = encode_binary_u32(p, c->repeat_count);
+        p = encode_binary_u32(p, c->first_repeat);
+        p = encode_binary_u32(p, c->last_repeat);
     }
-    GLOBAL_LOGGER.level = level;
-    GLOBAL_LOGGER.flush_level = LL_TRACE;
+    sink_write(logger, record, p - record);
+    c->repeat_count = 0;
+    __atomic_store_n(&c->run_open, false, __ATOMIC_RELAXED);
+}
+
+// Needs the encode_lock, returns true if record repeats the last written record and was counted instead.
+// Otherwise the run ends and record becomes the record that the following ones are compared with.
+static bool coalescer_add(Logger *logger, const char *record, size_t size, uint32_t timestamp) {
+    Coalescer *c = &logger->coalescer;
+
+    // A plain record is the i32 module key, the u32 callsite index, the u32 timestamp and the arguments
+    constexpr size_t ID_SIZE = sizeof(int32_t) + sizeof(uint32_t);
+    constexpr size_t TIMESTAMP_END = ID_SIZE + sizeof(uint32_t);
+    bool repeated = c->size == size && memcmp(c->record, record, ID_SIZE) == 0 &&
+                    memcmp(c->record + TIMESTAMP_END, record + TIMESTAMP_END, size - TIMESTAMP_END) == 0;
+
+    if (repeated && timestamp - c->timestamp < logger->coalesce_ms) {
+        if (c->repeat_count == 0) {
+            c->first_repeat = timestamp;
+            __atomic_store_n(&c->run_open, true, __ATOMIC_RELAXED);
+        }
+        c->repeat_count += 1;
+        c->last_repeat = timestamp;
+        return true;
+    }
+
+    coalescer_end_run(logger, false);
+    if (size > c->capacity) {
+        char *grown = realloc(c->record, size);
+        if (grown == nullptr) {
+            c->size = 0;
+            return false;
+        }
+        c->record = grown;
+        c->capacity = size;
+    }
+    memcpy(c->record, record, size);
+    c->size = size;
+    c->timestamp = timestamp;
+    return false;
+}
+
+// Writes the open run once it is coalesce_ms old, no later record can join it anymore
+static void coalescer_end_expired_run(Logger *logger, uint32_t timestamp) {
+    pthread_mutex_lock(&logger->encode_lock);
+    Coalescer *c = &logger->coalescer;
+    if (c->repeat_count > 0 && timestamp - c->timestamp >= logger->coalesce_ms) coalescer_end_run(logger, false);
+    pthread_mutex_unlock(&logger->encode_lock);
+}
+
+// The next dump of a flight recorder announces the images again
+static void logger_forget_modules(Logger *logger) {
+    pthread_mutex_lock(&logger->encode_lock);
+    __atomic_store_n(&logger->modules_written, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&logger->encode_lock);
+}
+
+// Flushes the sink, the repetitions counted so far are written first
+static void logger_flush(Logger *logger) {
+    if (logger->coalesce_ms > 0) {
+        pthread_mutex_lock(&logger->encode_lock);
+        // Flight recorder dumps empty the ring, the record of the run is not in the next dump
+        coalescer_end_run(logger, logger->sink == CSL_SINK_FLIGHT_RECORDER);
+        pthread_mutex_unlock(&logger->encode_lock);
+    }
+    sink_flush(logger);
+    if (logger->sink == CSL_SINK_FLIGHT_RECORDER) logger_forget_modules(logger);
+}
+
+static size_t encode_file_header(char *buffer, uint32_t flags) {
+    char *p = buffer;
+    p = encode_binary_u32(p, LOGGING_FILE_HEADER_MAGIC_NUMBER);
+    p = encode_binary_u32(p, LOGGING_FILE_HEADER_VERSION_NUMBER);
+
+    // The build id of the image with the library, zero padded to 32 bytes, the flags and the reserved bytes follow
+    callsite_image_build_id(&GLOBAL_LOGGER, p);
+    p += 32;
+    p = encode_binary_u32(p, flags);
+    memset(p, 0, LOGGING_FILE_HEADER_RESERVED_COUNT);
+    p += LOGGING_FILE_HEADER_RESERVED_COUNT;
+
+    return p - buffer;
+}
+static_assert(4 + 4 + 32 + 4 + LOGGING_FILE_HEADER_RESERVED_COUNT == LOGGING_FILE_HEADER_SIZE);
+
+static bool sink_open(Logger *logger, const char *name, const LoggerConfig *config) {
+    char file_header[LOGGING_FILE_HEADER_SIZE];
+    encode_file_header(file_header, config->compact ? CSL_FILE_FLAG_COMPACT : 0);
+
+    switch (logger->sink) {
+        case CSL_SINK_FILE:
+            logger->logfile = fopen(name, "wb");
+            if (logger->logfile == nullptr) return false;
+            sink_write(logger, file_header, sizeof file_header);
+            return true;
+        case CSL_SINK_SHM:
+            logger->ring = shm_ring_create(name, config->buffer_size ? config->buffer_size : DEFAULT_SHM_RING_SIZE,
+                                           file_header);
+            return logger->ring != nullptr;
+        case CSL_SINK_SHARED_FILE:
+            // The file is not truncated, the header is only written by the process that creates it
+            logger->append = append_writer_create(name,
+                                                  config->buffer_size ? config->buffer_size : DEFAULT_APPEND_BUFFER_SIZE,
+                                                  file_header);
+            return logger->append != nullptr;
+        case CSL_SINK_FLIGHT_RECORDER:
+            // Nothing is written until the first dump, name is the base name of the dump files
+            logger->flight = flight_recorder_create(name,
+                                                    config->buffer_size ? config->buffer_size : DEFAULT_FLIGHT_RECORDER_SIZE,
+                                                    file_header);
+            return logger->flight != nullptr;
+        case CSL_SINK_SOCKET:
+            logger->socket = socket_writer_create(name,
+                                                  config->buffer_size ? config->buffer_size : DEFAULT_SOCKET_BUFFER_SIZE,
+                                                  config->buffer_count ? config->buffer_count : DEFAULT_SOCKET_BUFFER_COUNT,
+                                                  file_header);
+            return logger->socket != nullptr;
+        case CSL_SINK_IO_URING:
+#ifdef CSL_IO_URING_AVAILABLE
+            logger->uring = uring_writer_create(name,
+                                                config->buffer_size ? config->buffer_size : DEFAULT_URING_BUFFER_SIZE,
+                                                config->buffer_count ? config->buffer_count : DEFAULT_URING_BUFFER_COUNT,
+                                                config->direct_io, config->compact);
+            if (logger->uring == nullptr) return false;
+            uring_writer_write(logger->uring, file_header, sizeof file_header);
+            return true;
+#else
+            return false;
+#endif
+        case CSL_SINK_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+static bool logger_init(Logger *logger, const char *name, const LoggerConfig *config) {
+    *logger = (Logger) {
+        .sink = config->sink,
+        .level = config->level,
+        .flush_level = config->flush_level,
+    };
+    if (logger->sink == CSL_SINK_FLIGHT_RECORDER) {
+        logger->flush_level = config->dump_level != LL_TRACE ? config->dump_level : LL_ERROR;
+    }
+    if (logger->sink >= CSL_SINK_COUNT) return false;
+    if (config->compact && logger->sink != CSL_SINK_FILE && logger->sink != CSL_SINK_IO_URING) return false;
+    bool shared_stream = logger->sink == CSL_SINK_SHARED_FILE || logger->sink == CSL_SINK_SOCKET;
+    if (config->coalesce_ms > 0 && shared_stream) return false;
+
+    if (!sink_open(logger, name, config)) return false;
+    pthread_mutex_init(&logger->lock, nullptr);
+    pthread_mutex_init(&logger->encode_lock, nullptr);
+    logger->compact = config->compact;
+    logger->coalesce_ms = config->coalesce_ms;
+    logger->is_open = true;
+
+    callsite_track_level(LL_COUNT, logger->level);
+    return true;
+}
+
+// Held while a signal dumps a logger, so logger_deinit waits for the dump to finish
+static pthread_mutex_t DUMP_SIGNAL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static Logger *DUMP_SIGNAL_LOGGERS[NSIG];
+
+static void logger_deinit(Logger *logger) {
+    if (!logger->is_open) return;
+    logger->is_open = false;
+
+    pthread_mutex_lock(&DUMP_SIGNAL_LOCK);
+    for (int signo = 0; signo < NSIG; ++signo) {
+        if (DUMP_SIGNAL_LOGGERS[signo] == logger) DUMP_SIGNAL_LOGGERS[signo] = nullptr;
+    }
+    pthread_mutex_unlock(&DUMP_SIGNAL_LOCK);
+
+    pthread_mutex_lock(&logger->encode_lock);
+    coalescer_end_run(logger, true);
+    pthread_mutex_unlock(&logger->encode_lock);
+
+    sink_close(logger);
+    pthread_mutex_destroy(&logger->lock);
+    pthread_mutex_destroy(&logger->encode_lock);
+    free(logger->codes.headers);
+    free(logger->codes.indices);
+    logger->codes = (CallsiteCodes) {};
+    free(logger->coalescer.record);
+    logger->coalescer = (Coalescer) {};
+    callsite_track_level(logger->level, LL_COUNT);
+}
+
+csl_logger_t *csl_logger_open(const char *name, const LoggerConfig *config) {
+    LoggerConfig default_config = {.level = LL_INFO, .flush_level = LL_INFO};
+    if (config == nullptr) config = &default_config;
+
+    Logger *logger = malloc(sizeof *logger);
+    if (logger == nullptr) return nullptr;
+
+    if (!logger_init(logger, name, config)) {
+        free(logger);
+        return nullptr;
+    }
+    return logger;
+}
+
+void csl_logger_close(csl_logger_t *logger) {
+    if (logger == nullptr) return;
+    logger_deinit(logger);
+    free(logger);
+}
+
+void csl_logger_set_level(csl_logger_t *logger, LogLevel level) {
+    if (logger == nullptr) logger = &GLOBAL_LOGGER;
+    if (logger->is_open) callsite_track_level(logger->level, level);
+    logger->level = level;
+}
+
+void csl_logger_flush(csl_logger_t *logger) {
+    if (logger == nullptr) logger = &GLOBAL_LOGGER;
+    if (!logger->is_open) return;
+    logger_flush(logger);
+}
+
+bool csl_logger_dump(csl_logger_t *logger, const char *filename) {
+    if (logger == nullptr) logger = &GLOBAL_LOGGER;
+    if (!logger->is_open || logger->sink != CSL_SINK_FLIGHT_RECORDER) return false;
+
+    pthread_mutex_lock(&logger->encode_lock);
+    coalescer_end_run(logger, true);
+    pthread_mutex_unlock(&logger->encode_lock);
+
+    pthread_mutex_lock(&logger->lock);
+    bool ok = flight_recorder_dump(logger->flight, filename);
+    pthread_mutex_unlock(&logger->lock);
+    logger_forget_modules(logger);
+    return ok;
+}
+
+// Runs on the signal helper thread, so the dump also happens in a hung or idle process
+static void dump_on_signal(int signo) {
+    pthread_mutex_lock(&DUMP_SIGNAL_LOCK);
+    Logger *logger = DUMP_SIGNAL_LOGGERS[signo];
+    if (logger != nullptr) csl_logger_dump(logger, nullptr);
+    pthread_mutex_unlock(&DUMP_SIGNAL_LOCK);
+}
+
+void csl_logger_dump_on_signal(csl_logger_t *logger, int signo) {
+    if (logger == nullptr) logger = &GLOBAL_LOGGER;
+    if (signo <= 0 || signo >= NSIG) return;
+    pthread_mutex_lock(&DUMP_SIGNAL_LOCK);
+    DUMP_SIGNAL_LOGGERS[signo] = logger;
+    pthread_mutex_unlock(&DUMP_SIGNAL_LOCK);
+
+    signal_thread_watch(signo, dump_on_signal);
+}
+
+void csl_easy_init(const char *filename, LogLevel level) {
+    LoggerConfig config = {.level = level, .flush_level = LL_TRACE};
+    logger_init(&GLOBAL_LOGGER, filename, &config);
 }
 
 void csl_easy_end() {
-    fclose(GLOBAL_LOGGER.logfile);
+    logger_deinit(&GLOBAL_LOGGER);
 }
 
-void csl_log_call(const LogHeader *header, LoggingValueU *values) {
-    Logger *logger = &GLOBAL_LOGGER;
+static size_t record_size(const LogHeader *header, LoggingValueU *values, uint32_t *string_lengths) {
+    size_t size = sizeof(int32_t) + sizeof(uint32_t) + sizeof(uint32_t);
+
+    for (size_t i = 0; i < header->arg_count; ++i) {
+        switch (header->types[i]) {
+            case TYPE_I32:
+            case TYPE_U32:
+            case TYPE_F32:
+                size += 4;
+                break;
+            case TYPE_U8:
+                size += 1;
+                break;
+            case TYPE_CSTRING:
+                string_lengths[i] = strlen(values[i].val_cstring) + 1;
+                size += sizeof(uint32_t) + string_lengths[i];
+                break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+            case TYPE_BLOB:
+                // Arrays keep their byte count in string_lengths as well
+                string_lengths[i] = values[i].val_array.count * DATA_TYPE_ELEMENT_SIZES[header->types[i]];
+                size += sizeof(uint32_t) + string_lengths[i];
+                break;
+            case TYPE_COUNT:
+                unreachable();
+        }
+    }
+    return size;
+}
 
-    if (header->level < logger->level) return;
+static void encode_record(char *p, const LogHeader *header, int64_t logging_id, uint32_t timestamp,
+                          LoggingValueU *values, const uint32_t *string_lengths) {
+    p = encode_binary_i32(p, csl_callsite_id_module(logging_id));
+    p = encode_binary_u32(p, csl_callsite_id_index(logging_id));
+    p = encode_binary_u32(p, timestamp);
 
-    int32_t logging_id = get_logging_id(header);
-    uint32_t timestamp = (int)get_current_time_ms();
+    for (size_t i = 0; i < header->arg_count; ++i) {
+        switch (header->types[i]) {
+            case TYPE_I32:
+                p = encode_binary_i32(p, values[i].val_int);
+                break;
+            case TYPE_F32:
+                p = encode_binary_f32(p, values[i].val_float);
+                break;
+            case TYPE_CSTRING:
+                p = encode_binary_cstring(p, values[i].val_cstring, string_lengths[i]);
+                break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+            case TYPE_BLOB:
+                p = encode_binary_array(p, values[i].val_array, string_lengths[i]);
+                break;
+            case TYPE_U8:
+                p = encode_binary_u8(p, values[i].val_uint8);
+                break;
+            case TYPE_U32:
+                p = encode_binary_u32(p, values[i].val_uint);
+                break;
+            case TYPE_COUNT:
+                unreachable();
+        }
+    }
+}
 
-    write_binary_i32(logging_id, logger->logfile);
-    write_binary_u32(timestamp, logger->logfile);
+static size_t callsite_codes_slot(const CallsiteCodes *codes, const LogHeader *header) {
+    uint64_t h = (uint64_t)(uintptr_t)header;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    size_t slot = h & (codes->slot_count - 1);
+    while (codes->headers[slot] != nullptr && codes->headers[slot] != header) {
+        slot = (slot + 1) & (codes->slot_count - 1);
+    }
+    return slot;
+}
+
+static bool callsite_codes_grow(CallsiteCodes *codes) {
+    CallsiteCodes grown = {.slot_count = codes->slot_count == 0 ? 256 : 2 * codes->slot_count, .size = codes->size};
+    grown.headers = calloc(grown.slot_count, sizeof(grown.headers[0]));
+    grown.indices = malloc(grown.slot_count * sizeof(grown.indices[0]));
+    if (grown.headers == nullptr || grown.indices == nullptr) {
+        free(grown.headers);
+        free(grown.indices);
+        return false;
+    }
+
+    for (size_t i = 0; i < codes->slot_count; ++i) {
+        if (codes->headers[i] == nullptr) continue;
+        size_t slot = callsite_codes_slot(&grown, codes->headers[i]);
+        grown.headers[slot] = codes->headers[i];
+        grown.indices[slot] = codes->indices[i];
+    }
+
+    free(codes->headers);
+    free(codes->indices);
+    *codes = grown;
+    return true;
+}
+
+// Returns false if a new callsite can't be added, is_new tells that the index was assigned just now
+static bool callsite_codes_get(CallsiteCodes *codes, const LogHeader *header, uint32_t *index, bool *is_new) {
+    if (2 * (codes->size + 1) > codes->slot_count && !callsite_codes_grow(codes)) return false;
+
+    size_t slot = callsite_codes_slot(codes, header);
+    *is_new = codes->headers[slot] == nullptr;
+    if (*is_new) {
+        codes->headers[slot] = header;
+        codes->indices[slot] = codes->size++;
+    }
+    *index = codes->indices[slot];
+    return true;
+}
+
+// Upper bound of the bytes encode_record_compact needs more than encode_record, a varint takes up to 5 bytes
+static size_t compact_record_extra_size(const LogHeader *header) {
+    // Code, module key and index of a new callsite instead of the id, the timestamp and one byte per integer argument
+    return (5 + 5 + 5 - 8) + 1 + header->arg_count;
+}
+
+// Needs the encode_lock, returns the size of the record or 0 if it can't be encoded
+static size_t encode_record_compact(Logger *logger, char *buffer, const LogHeader *header, int64_t logging_id,
+                                    uint32_t timestamp, LoggingValueU *values, const uint32_t *string_lengths) {
+    uint32_t index;
+    bool is_new;
+    if (!callsite_codes_get(&logger->codes, header, &index, &is_new)) return 0;
+
+    char *p = buffer;
+    if (is_new) {
+        p = encode_binary_varint_u32(p, CSL_COMPACT_CODE_NEW);
+        p = encode_binary_varint_i32(p, csl_callsite_id_module(logging_id));
+        p = encode_binary_varint_u32(p, csl_callsite_id_index(logging_id));
+    } else {
+        p = encode_binary_varint_u32(p, CSL_COMPACT_CODE_FIRST_INDEX + index);
+    }
+    p = encode_binary_varint_i32(p, (int32_t)(timestamp - logger->last_timestamp));
+    logger->last_timestamp = timestamp;
 
     for (size_t i = 0; i < header->arg_count; ++i) {
         switch (header->types[i]) {
             case TYPE_I32:
-                write_binary_i32(values[i].val_int, logger->logfile);
+                p = encode_binary_varint_i32(p, values[i].val_int);
                 break;
             case TYPE_F32:
-                write_binary_f32(values[i].val_float, logger->logfile);
+                p = encode_binary_f32(p, values[i].val_float);
                 break;
             case TYPE_CSTRING:
-                write_binary_cstring(values[i].val_cstring, logger->logfile);
+                p = encode_binary_cstring(p, values[i].val_cstring, string_lengths[i]);
+                break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+            case TYPE_BLOB:
+                p = encode_binary_array(p, values[i].val_array, string_lengths[i]);
                 break;
             case TYPE_U8:
-                write_binary_u8(values[i].val_uint8, logger->logfile);
+                p = encode_binary_u8(p, values[i].val_uint8);
                 break;
             case TYPE_U32:
-                write_binary_u32(values[i].val_uint, logger->logfile);
+                p = encode_binary_varint_u32(p, values[i].val_uint);
                 break;
             case TYPE_COUNT:
                 unreachable();
         }
     }
+    return p - buffer;
+}
+
+static void logger_write_modules(Logger *logger) {
+    pthread_mutex_lock(&logger->encode_lock);
+    uint32_t count = __atomic_load_n(&CSL_MODULE_COUNT, __ATOMIC_ACQUIRE);
+    for (uint32_t i = logger->modules_written; i < count; ++i) {
+        char record[5 + 5 + CSL_MODULE_RECORD_SIZE];
+        char *p = record;
+        if (logger->compact) {
+            p = encode_binary_varint_u32(p, CSL_COMPACT_CODE_NEW);
+            p = encode_binary_varint_i32(p, CSL_RECORD_MODULE);
+        } else {
+            p = encode_binary_i32(p, CSL_RECORD_MODULE);
+        }
+        p = callsite_encode_module(p, i);
+        sink_write(logger, record, p - record);
+    }
+    __atomic_store_n(&logger->modules_written, count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&logger->encode_lock);
+}
+
+// Registers a new callsite, false if the callsite is disabled, below the level of the logger or the logger is closed
+static bool logger_accepts(const Logger *logger, const LogHeader *header) {
+    CallsiteState state = __atomic_load_n(&header->state, __ATOMIC_RELAXED);
+    // The header is always a static, writable object created by LOG_TO
+    if (state == CSL_CALLSITE_NEW) state = callsite_register((LogHeader *)header);
+    if (state == CSL_CALLSITE_DISABLED) return false;
+
+    if (state != CSL_CALLSITE_FORCED && header->level < logger->level) return false;
+    return logger->is_open;
+}
+
+void csl_logger_log(csl_logger_t *logger, const LogHeader *header, LoggingValueU *values) {
+    if (logger == nullptr) logger = &GLOBAL_LOGGER;
+
+    // An expired run is written before this message is looked at, also if the message is filtered out
+    if (logger->coalesce_ms > 0 && __atomic_load_n(&logger->coalescer.run_open, __ATOMIC_RELAXED)) {
+        coalescer_end_expired_run(logger, get_current_time_ms());
+    }
+
+    if (!logger_accepts(logger, header)) return;
+
+    int64_t logging_id = get_logging_id(header);
+    // Registering a callsite can find a new image, it is announced before the first record of the callsite
+    uint32_t module_count = __atomic_load_n(&CSL_MODULE_COUNT, __ATOMIC_RELAXED);
+    if (module_count != __atomic_load_n(&logger->modules_written, __ATOMIC_RELAXED)) logger_write_modules(logger);
+    uint32_t timestamp = (int)get_current_time_ms();
+
+    uint32_t string_lengths[CSL_MAX_ARG_COUNT];
+    size_t plain_size = record_size(header, values, string_lengths);
+    size_t size = plain_size;
+    if (logger->compact) size += compact_record_extra_size(header);
+
+    char stack_buffer[RECORD_STACK_BUFFER_SIZE];
+    char *buffer = size <= sizeof stack_buffer ? stack_buffer : malloc(size);
+    if (buffer == nullptr) return;
+
+    if (logger->coalesce_ms > 0) {
+        // The plain encoding is compared with the last record, repetitions are only counted
+        pthread_mutex_lock(&logger->encode_lock);
+        encode_record(buffer, header, logging_id, timestamp, values, string_lengths);
+        bool repeated = coalescer_add(logger, buffer, plain_size, timestamp);
+        if (!repeated && logger->compact) {
+            size = encode_record_compact(logger, buffer, header, logging_id, timestamp, values, string_lengths);
+            if (size > 0) sink_write(logger, buffer, size);
+            else logger->coalescer.size = 0;
+        } else if (!repeated) {
+            sink_write(logger, buffer, plain_size);
+        }
+        pthread_mutex_unlock(&logger->encode_lock);
+
+        if (repeated) {
+            if (buffer != stack_buffer) free(buffer);
+            return;
+        }
+    } else if (logger->compact) {
+        // Dictionary and timestamp deltas only decode if the records are written in the order they are encoded
+        pthread_mutex_lock(&logger->encode_lock);
+        size = encode_record_compact(logger, buffer, header, logging_id, timestamp, values, string_lengths);
+        if (size > 0) sink_write(logger, buffer, size);
+        pthread_mutex_unlock(&logger->encode_lock);
+    } else {
+        encode_record(buffer, header, logging_id, timestamp, values, string_lengths);
+        sink_write(logger, buffer, size);
+    }
+
+    if (buffer != stack_buffer) free(buffer);
 
     if (header->level >= logger->flush_level)
-        fflush(logger->logfile);
+        logger_flush(logger);
 }
 
+static uint32_t NEXT_SPAN_ID = 1;
+static thread_local uint32_t THREAD_ID = 0;
+
+static void log_span_event(csl_logger_t *logger, const LogHeader *header, uint32_t span_id) {
+    if (THREAD_ID == 0) THREAD_ID = (uint32_t)gettid();
+
+    // The same clock as the record timestamp, so log_printer can restore the upper bits from it
+    struct timeval ts;
+    gettimeofday(&ts, NULL);
+    uint32_t micros = (uint32_t)(ts.tv_sec * 1000000 + ts.tv_usec);
+
+    csl_logger_log(logger, header, (LoggingValueU[]) {{.val_uint = span_id}, {.val_uint = THREAD_ID}, {.val_uint = micros}});
+}
 
+uint32_t csl_span_begin(csl_logger_t *logger, const LogHeader *header) {
+    // No id for a span whose begin is not logged, its end is then skipped as well
+    if (!logger_accepts(logger != nullptr ? logger : &GLOBAL_LOGGER, header)) return 0;
+
+    uint32_t span_id = __atomic_fetch_add(&NEXT_SPAN_ID, 1, __ATOMIC_RELAXED);
+    if (span_id == 0) span_id = __atomic_fetch_add(&NEXT_SPAN_ID, 1, __ATOMIC_RELAXED);
+
+    log_span_event(logger, header, span_id);
+    return span_id;
+}
+
+void csl_span_end(csl_logger_t *logger, const LogHeader *header, uint32_t span_id) {
+    if (span_id == 0 || __atomic_load_n(&header->state, __ATOMIC_RELAXED) == CSL_CALLSITE_DISABLED) return;
+    log_span_event(logger, header, span_id);
+}
+
+void csl_span_scope_end(CslSpanScope *scope) {
+    csl_span_end(scope->logger, scope->end_header, scope->id);
+}
+
+void csl_log_call(const LogHeader *header, LoggingValueU *values) {
+    csl_logger_log(&GLOBAL_LOGGER, header, values);
+}
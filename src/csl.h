@@ -12,7 +12,12 @@ constexpr int CSL_MAX_ARG_COUNT = 10;
     int32_t : TYPE_I32,             \
     float:    TYPE_F32,             \
     const char *: TYPE_CSTRING,     \
-    char *: TYPE_CSTRING            \
+    char *: TYPE_CSTRING,           \
+    CslArrayU8: TYPE_U8_ARRAY,      \
+    CslArrayU32: TYPE_U32_ARRAY,    \
+    CslArrayI32: TYPE_I32_ARRAY,    \
+    CslArrayF32: TYPE_F32_ARRAY,    \
+    CslBlob: TYPE_BLOB              \
 )
 
 typedef enum: uint8_t {
@@ -21,15 +26,42 @@ typedef enum: uint8_t {
     TYPE_I32,
     TYPE_F32,
     TYPE_CSTRING,
+    // A u32 element count followed by the elements, written with one memcpy
+    TYPE_U8_ARRAY,
+    TYPE_U32_ARRAY,
+    TYPE_I32_ARRAY,
+    TYPE_F32_ARRAY,
+    // Raw bytes, the count is the byte count
+    TYPE_BLOB,
     TYPE_COUNT
 } DataType;
 
+// Pointer and element count of an array argument, the elements are copied when the message is logged:
+//   LOG("samples {}", LL_DEBUG, CSL_ARRAY_F32(samples, sample_count));
+typedef struct { const uint8_t *data;  uint32_t count; } CslArrayU8;
+typedef struct { const uint32_t *data; uint32_t count; } CslArrayU32;
+typedef struct { const int32_t *data;  uint32_t count; } CslArrayI32;
+typedef struct { const float *data;    uint32_t count; } CslArrayF32;
+typedef struct { const void *data;     uint32_t count; } CslBlob;
+
+#define CSL_ARRAY_U8(PTR, COUNT)  ((CslArrayU8)  {.data = (PTR), .count = (uint32_t)(COUNT)})
+#define CSL_ARRAY_U32(PTR, COUNT) ((CslArrayU32) {.data = (PTR), .count = (uint32_t)(COUNT)})
+#define CSL_ARRAY_I32(PTR, COUNT) ((CslArrayI32) {.data = (PTR), .count = (uint32_t)(COUNT)})
+#define CSL_ARRAY_F32(PTR, COUNT) ((CslArrayF32) {.data = (PTR), .count = (uint32_t)(COUNT)})
+#define CSL_BLOB(PTR, BYTE_COUNT) ((CslBlob)     {.data = (PTR), .count = (uint32_t)(BYTE_COUNT)})
+
+typedef struct {
+    const void *data;
+    uint32_t count;
+} LoggingArray;
+
 typedef union {
     int32_t val_int;
     uint32_t val_uint;
     uint8_t val_uint8;
     float val_float;
     const char * val_cstring;
+    LoggingArray val_array;
 } LoggingValueU;
 
 static inline LoggingValueU logging_value_i32(int32_t v)            { return (LoggingValueU) {.val_int = v}; }
@@ -37,6 +69,11 @@ static inline LoggingValueU logging_value_u32(uint32_t v)           { return (Lo
 static inline LoggingValueU logging_value_u8(uint8_t v)             { return (LoggingValueU) {.val_uint8 = v}; }
 static inline LoggingValueU logging_value_float(float v)            { return (LoggingValueU) {.val_float = v}; }
 static inline LoggingValueU logging_value_cstring(const char *v)    { return (LoggingValueU) {.val_cstring = v}; }
+static inline LoggingValueU logging_value_u8_array(CslArrayU8 v)    { return (LoggingValueU) {.val_array = {v.data, v.count}}; }
+static inline LoggingValueU logging_value_u32_array(CslArrayU32 v)  { return (LoggingValueU) {.val_array = {v.data, v.count}}; }
+static inline LoggingValueU logging_value_i32_array(CslArrayI32 v)  { return (LoggingValueU) {.val_array = {v.data, v.count}}; }
+static inline LoggingValueU logging_value_f32_array(CslArrayF32 v)  { return (LoggingValueU) {.val_array = {v.data, v.count}}; }
+static inline LoggingValueU logging_value_blob(CslBlob v)           { return (LoggingValueU) {.val_array = {v.data, v.count}}; }
 
 #define LOGGING_VALUE_G(X) _Generic((X),    \
     uint8_t: logging_value_u8,              \
@@ -44,7 +81,12 @@ static inline LoggingValueU logging_value_cstring(const char *v)    { return (Lo
     int32_t : logging_value_i32,            \
     float:    logging_value_float,          \
     const char *: logging_value_cstring,    \
-    char *: logging_value_cstring           \
+    char *: logging_value_cstring,          \
+    CslArrayU8: logging_value_u8_array,     \
+    CslArrayU32: logging_value_u32_array,   \
+    CslArrayI32: logging_value_i32_array,   \
+    CslArrayF32: logging_value_f32_array,   \
+    CslBlob: logging_value_blob             \
 ) ((X))
 
 typedef enum: uint8_t {
@@ -69,6 +111,13 @@ typedef struct {
     char *data;
 } MemoryView;
 
+typedef enum: uint8_t {
+    CSL_CALLSITE_NEW,       // not seen by a logger yet
+    CSL_CALLSITE_ENABLED,   // logged if the level of the logger allows it
+    CSL_CALLSITE_FORCED,    // enabled by a control rule regardless of the logger level
+    CSL_CALLSITE_DISABLED,  // skipped before csl_logger_log is called
+} CallsiteState;
+
 #define LOGGING_HEADER_MAGIC_NUMBER {'[', 'C', '#', 'S', '%', 'L', '*', ']'}
 typedef struct {
     char MARKER[8];
@@ -81,39 +130,150 @@ typedef struct {
     StringView function;
     int line;
 
-    int32_t  id;
+    // Computed when the callsite is registered, see csl_callsite_id_make
+    int64_t id;
 
     LogLevel level;
     char category;
+    CallsiteState state;
 } LogHeader;
 
 constexpr uint32_t LOGGING_FILE_HEADER_MAGIC_NUMBER = 0x43534c4c;
-constexpr int32_t LOGGING_FILE_HEADER_VERSION_NUMBER = 1;
-constexpr int LOGGING_FILE_HEADER_RESERVED_COUNT = 24;
+constexpr int32_t LOGGING_FILE_HEADER_VERSION_NUMBER = 2;
+constexpr int LOGGING_FILE_HEADER_RESERVED_COUNT = 20;
+constexpr size_t LOGGING_FILE_HEADER_SIZE = 64;
+// Bits of the u32 flags that follow the build id in the file header
+constexpr uint32_t CSL_FILE_FLAG_COMPACT = 1;
+
+// A callsite id has the module key of the image with the LogHeader in the upper 32 bits and the callsite index, the
+// address of the LogHeader relative to the load address of the image in units of its alignment, in the lower 32 bits.
+// Both are the same in every process and for every load address, log_printer gets them from the ELF file.
+static inline int64_t csl_callsite_id_make(int32_t module_key, uint32_t callsite_index) {
+    return (int64_t)(((uint64_t)(uint32_t)module_key << 32) | callsite_index);
+}
+static inline int32_t csl_callsite_id_module(int64_t id) { return (int32_t)((uint64_t)id >> 32); }
+static inline uint32_t csl_callsite_id_index(int64_t id) { return (uint32_t)id; }
+
+// The module key is taken from the build id, 0 for an image without one. It is never negative.
+static inline int32_t csl_module_key(const char *build_id, size_t byte_count) {
+    uint32_t key = 0;
+    for (size_t i = 0; i < byte_count && i < sizeof key; ++i) key |= (uint32_t)(uint8_t)build_id[i] << (8 * i);
+    return (int32_t)(key & INT32_MAX);
+}
+
+// A LOG record starts with the callsite id as i32 module key and u32 callsite index, followed by the u32 timestamp.
+// Negative module keys at the bottom of the int32_t range mark records that don't belong to a LOG callsite.
+// Padding: followed by a u32 byte count that is skipped, used to align O_DIRECT writes
+constexpr int32_t CSL_RECORD_PADDING = INT32_MIN;
+constexpr size_t CSL_PADDING_RECORD_SIZE = 8;
+// Batch: followed by the u32 pid of the writing process and the u32 byte count of its records that follow
+constexpr int32_t CSL_RECORD_BATCH = INT32_MIN + 1;
+constexpr size_t CSL_BATCH_RECORD_SIZE = 12;
+// Repeat: followed by the u32 number of repetitions of the previous record and the u32 timestamps of the first and
+// the last repetition, written instead of the repetitions by loggers with coalesce_ms
+constexpr int32_t CSL_RECORD_REPEAT = INT32_MIN + 2;
+constexpr size_t CSL_REPEAT_RECORD_SIZE = 16;
+// Process: followed by the u32 pid and the 32 byte build id of a process, written by csl_collectd before the first
+// batch of the process in every segment. The build id in the file header of a segment is all zeros.
+constexpr int32_t CSL_RECORD_PROCESS = INT32_MIN + 3;
+constexpr size_t CSL_PROCESS_RECORD_SIZE = 40;
+// Module: followed by the i32 module key, the u64 load address and the 32 byte build id of an image with callsites,
+// written by every logger before the first record of a callsite of the image
+constexpr int32_t CSL_RECORD_MODULE = INT32_MIN + 4;
+constexpr size_t CSL_MODULE_RECORD_SIZE = 48;
+
+// CSL_SINK_SOCKET sends one SOCK_SEQPACKET message with its file header after connecting to csl_collectd,
+// every following message is a batch of records of at most this size
+constexpr size_t CSL_COLLECTOR_MAX_BATCH_SIZE = 64 << 10;
+
+// With CSL_FILE_FLAG_COMPACT every record starts with a varint code instead of the callsite id:
+//   0:      a callsite that is new in the stream, its zig-zag varint module key and varint callsite index follow and
+//           it gets the next dictionary index
+//   1:      padding, followed by a u32 byte count that is skipped
+//   n >= 2: the callsite with dictionary index n - 2
+// The timestamp follows as zig-zag varint delta to the previous record, i32 and u32 args as (zig-zag) varints.
+// A repeat record is code 0 with the module key CSL_RECORD_REPEAT and no dictionary index, followed by the varint
+// count, the zig-zag varint delta of the first repetition to the previous timestamp and the varint delta of the
+// last one.
+// A module record is code 0 with the module key CSL_RECORD_MODULE followed by the fields of the plain module record.
+constexpr uint32_t CSL_COMPACT_CODE_NEW = 0;
+constexpr uint32_t CSL_COMPACT_CODE_PADDING = 1;
+constexpr uint32_t CSL_COMPACT_CODE_FIRST_INDEX = 2;
+constexpr size_t CSL_COMPACT_PADDING_RECORD_SIZE = 5;
+
+constexpr uint32_t CSL_SHM_RING_MAGIC_NUMBER = 0x43534c52;
+// Start of the shared memory object written by the CSL_SINK_SHM sink, the records follow at data_offset
+typedef struct {
+    uint32_t magic;
+    uint32_t data_offset;
+    uint64_t capacity;
+    // Bytes the producer started to write and bytes that are completely written, always at a record boundary
+    uint64_t reserve_pos;
+    uint64_t write_pos;
+    uint32_t closed;
+    char file_header[LOGGING_FILE_HEADER_SIZE];
+} ShmRingHeader;
 
 int args_find_position(const char *name, int argc, char **argv);
 const char* args_get_value(const char *name, int argc, char **argv);
+// Collects the values of an option that is given several times, values needs room for argc / 2 entries
+int args_get_values(const char *name, int argc, char **argv, const char **values);
+
+// Bump pointer allocator for decoded strings, arena_reset makes all of its memory reusable at once
+typedef struct ArenaBlock ArenaBlock;
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
 
 size_t read_binary_u8(uint8_t *v,       FILE *f);
 size_t read_binary_i32(int32_t *v,      FILE *f);
 size_t read_binary_u32(uint32_t *v,     FILE *f);
+size_t read_binary_u64(uint64_t *v,     FILE *f);
 size_t read_binary_f32(float *v,        FILE *f);
-size_t read_binary_cstring(char **v,    FILE *f);
-size_t read_binary_logging_value(LoggingValueU *v, DataType type, FILE *f);
+size_t read_binary_cstring(char **v,    Arena *strings, FILE *f);
+size_t read_binary_array(LoggingArray *v, size_t element_size, Arena *strings, FILE *f);
+size_t read_binary_varint_u32(uint32_t *v, FILE *f);
+size_t read_binary_varint_i32(int32_t *v,  FILE *f);
+// Both return 0 if the value is incomplete, strings and arrays are allocated from the arena
+size_t read_binary_logging_value(LoggingValueU *v, DataType type, Arena *strings, FILE *f);
 
 void write_binary_u8(uint8_t v,             FILE *f);
 void write_binary_i32(int32_t v,            FILE *f);
 void write_binary_u32(uint32_t v,           FILE *f);
 void write_binary_f32(float v,              FILE *f);
 void write_binary_cstring(const char *v,    FILE *f);
+
+char *encode_binary_u8(char *p, uint8_t v);
+char *encode_binary_i32(char *p, int32_t v);
+char *encode_binary_u32(char *p, uint32_t v);
+char *encode_binary_u64(char *p, uint64_t v);
+char *encode_binary_f32(char *p, float v);
+char *encode_binary_cstring(char *p, const char *v, uint32_t length);
+char *encode_binary_array(char *p, LoggingArray v, uint32_t byte_count);
+// At most 5 bytes each
+char *encode_binary_varint_u32(char *p, uint32_t v);
+char *encode_binary_varint_i32(char *p, int32_t v);
 //void write_binary_logging_value(LoggingValueU *v, DataType type, FILE *f);
 
 extern const StringView LOG_LEVEL_NAMES[];
 extern const char LOG_LEVEL_NAMES_SHORT[];
 extern const StringView DATA_TYPE_NAMES[];
+// Bytes per element of the array types, the size of the value for the other fixed size types, 0 for strings
+extern const uint8_t DATA_TYPE_ELEMENT_SIZES[];
+
+static inline bool data_type_is_array(DataType type) { return type >= TYPE_U8_ARRAY && type <= TYPE_BLOB; }
+
+
+typedef struct Logger csl_logger_t;
 
+#define LOG(FMT, LVL, ...) LOG_TO(nullptr, FMT, LVL __VA_OPT__(,) __VA_ARGS__)
 
-#define LOG(FMT, LVL, ...)                                                              \
+#define LOG_TO(LOGGER, FMT, LVL, ...)                                                   \
 do {                                                                                    \
 LogHeader* h_tmp = &(static LogHeader) {                                                \
     .MARKER = LOGGING_HEADER_MAGIC_NUMBER,                                              \
@@ -127,12 +287,53 @@ LogHeader* h_tmp = &(static LogHeader) {
     .id = 0\
     \
 };                                                                                              \
-csl_log_call(                                                                                       \
-    h_tmp,                                                                                      \
-    (LoggingValueU[]) { CALL_MACRO_X_FOR_EACH(LOGGING_VALUE_G __VA_OPT__(,) __VA_ARGS__) }      \
-);                                                                                              \
+if (__atomic_load_n(&h_tmp->state, __ATOMIC_RELAXED) != CSL_CALLSITE_DISABLED)                  \
+    csl_logger_log(                                                                             \
+        (LOGGER),                                                                               \
+        h_tmp,                                                                                  \
+        (LoggingValueU[]) { CALL_MACRO_X_FOR_EACH(LOGGING_VALUE_G __VA_OPT__(,) __VA_ARGS__) }  \
+    );                                                                                          \
 } while(0)
 
+// Spans are records of the categories 'B' and 'E' with the name as fmt_str and three u32 arguments:
+// the span id, the thread id and the microseconds of the wall clock (truncated to 32 bits)
+constexpr char CSL_CATEGORY_SPAN_BEGIN = 'B';
+constexpr char CSL_CATEGORY_SPAN_END = 'E';
+
+#define CSL_SPAN_HEADER(NAME, LVL, CATEGORY)                                            \
+&(static LogHeader) {                                                                   \
+    .MARKER = LOGGING_HEADER_MAGIC_NUMBER,                                              \
+    .fmt_str = SV(NAME),                                                                \
+    .arg_count = 3,                                                                     \
+    .types = {TYPE_U32, TYPE_U32, TYPE_U32},                                            \
+    .filename = SV(__FILE__),                                                           \
+    .function = {.byte_count = sizeof(__func__) - 1, .data = __func__},                 \
+    .line = __LINE__,                                                                   \
+    .level = LVL,                                                                       \
+    .category = CATEGORY,                                                               \
+}
+
+// CSL_SPAN_BEGIN returns the span id that is passed to the matching CSL_SPAN_END, 0 if the begin is not logged
+// (disabled callsite, below the level of the logger or closed logger), CSL_SPAN_END skips a span id of 0
+#define CSL_SPAN_BEGIN(NAME, LVL) CSL_SPAN_BEGIN_TO(nullptr, NAME, LVL)
+#define CSL_SPAN_END(NAME, LVL, SPAN_ID) CSL_SPAN_END_TO(nullptr, NAME, LVL, SPAN_ID)
+#define CSL_SPAN_BEGIN_TO(LOGGER, NAME, LVL) \
+    csl_span_begin((LOGGER), CSL_SPAN_HEADER(NAME, LVL, CSL_CATEGORY_SPAN_BEGIN))
+#define CSL_SPAN_END_TO(LOGGER, NAME, LVL, SPAN_ID) \
+    csl_span_end((LOGGER), CSL_SPAN_HEADER(NAME, LVL, CSL_CATEGORY_SPAN_END), (SPAN_ID))
+
+#define CSL_SPAN_CONCAT_(A, B) A##B
+#define CSL_SPAN_CONCAT(A, B) CSL_SPAN_CONCAT_(A, B)
+
+// Begins a span that ends when the enclosing scope is left, LOGGER is evaluated twice
+#define CSL_SPAN_SCOPE(NAME, LVL) CSL_SPAN_SCOPE_TO(nullptr, NAME, LVL)
+#define CSL_SPAN_SCOPE_TO(LOGGER, NAME, LVL)                                                    \
+[[gnu::cleanup(csl_span_scope_end)]] CslSpanScope CSL_SPAN_CONCAT(csl_span_scope_, __LINE__) = { \
+    .logger = (LOGGER),                                                                         \
+    .end_header = CSL_SPAN_HEADER(NAME, LVL, CSL_CATEGORY_SPAN_END),                            \
+    .id = CSL_SPAN_BEGIN_TO(LOGGER, NAME, LVL),                                                 \
+}
+
 #define CALL_MACRO_X_FOR_EACH(x, ...) \
     GET_NTH_ARG("", ##__VA_ARGS__, \
     _fe_9, _fe_8, _fe_7, _fe_6, _fe_5, _fe_4, _fe_3, _fe_2, _fe_1, _fe_0)(x, ##__VA_ARGS__)
@@ -148,6 +349,85 @@ csl_log_call(
 #define _fe_8(_call, x, ...) _call((x)), _fe_7(_call, __VA_ARGS__)
 #define _fe_9(_call, x, ...) _call((x)), _fe_8(_call, __VA_ARGS__)
 
+typedef enum: uint8_t {
+    CSL_SINK_FILE,
+    // Named POSIX shared memory ring for live consumers (log_printer --attach), never blocks the producer
+    CSL_SINK_SHM,
+    // Asynchronous writes from registered buffers through io_uring, optionally with O_DIRECT
+    CSL_SINK_IO_URING,
+    // One file shared by several processes, each appends batches of its records with a single O_APPEND write
+    CSL_SINK_SHARED_FILE,
+    // Records only go into an in-memory ring that overwrites the oldest ones, it is written to a log file by
+    // csl_logger_dump, by a message at or above dump_level or by the signal of csl_logger_dump_on_signal
+    CSL_SINK_FLIGHT_RECORDER,
+    // Batches of records go to the csl_collectd listening on the Unix domain socket name, they are kept in memory
+    // while the collector is not reachable or does not keep up, sending never blocks the producer.
+    // A record must fit into a batch of buffer_size bytes, at most CSL_COLLECTOR_MAX_BATCH_SIZE (64 KiB), larger
+    // records (long strings) are dropped and reported on stderr.
+    CSL_SINK_SOCKET,
+    CSL_SINK_COUNT
+} LoggerSink;
+
+typedef struct {
+    LogLevel level;
+    // Messages at or above this level are flushed to the file right away, not used by CSL_SINK_FLIGHT_RECORDER
+    LogLevel flush_level;
+    // Messages at or above this level dump the ring of CSL_SINK_FLIGHT_RECORDER to the next numbered file.
+    // LL_TRACE, the zero default, picks LL_ERROR, a dump per message would defeat the flight recorder.
+    LogLevel dump_level;
+    LoggerSink sink;
+    // Size of the buffer of sinks that keep records in memory, 0 picks a default
+    size_t buffer_size;
+    // Number of buffers of CSL_SINK_IO_URING, producers only wait if all of them are in flight.
+    // Number of batches CSL_SINK_SOCKET keeps while the collector is not reachable or busy, the oldest are dropped.
+    uint32_t buffer_count;
+    // Bypass the page cache, flushed writes are padded to the block size
+    bool direct_io;
+    // Varint callsite codes, timestamp deltas and integers (CSL_FILE_FLAG_COMPACT).
+    // Only for CSL_SINK_FILE and CSL_SINK_IO_URING, the other sinks have no single stream to delta encode.
+    bool compact;
+    // Consecutive records of the same callsite with the same arguments are only counted, a repeat record with the
+    // count and the first and last timestamp follows when the run ends or with the first message after it got this
+    // many ms old. A logger that stays idle writes the open run only on a flush or when it is closed.
+    // 0 turns coalescing off, not available for CSL_SINK_SHARED_FILE and CSL_SINK_SOCKET where the processes share
+    // the stream.
+    uint32_t coalesce_ms;
+} LoggerConfig;
+
+// name is the file name, the shared memory name (like "/my_log") for CSL_SINK_SHM or the socket path of the
+// collector for CSL_SINK_SOCKET
+csl_logger_t *csl_logger_open(const char *name, const LoggerConfig *config);
+void csl_logger_close(csl_logger_t *logger);
+void csl_logger_set_level(csl_logger_t *logger, LogLevel level);
+void csl_logger_flush(csl_logger_t *logger);
+// A nullptr logger logs to the default logger of the csl_easy_* api
+void csl_logger_log(csl_logger_t *logger, const LogHeader *header, LoggingValueU *values);
+// Writes the records of a CSL_SINK_FLIGHT_RECORDER logger to filename and empties its ring, a nullptr filename
+// writes "<name>.<n>" with n counting the dumps. Returns false for other sinks or if the file can't be written.
+bool csl_logger_dump(csl_logger_t *logger, const char *filename);
+// Dumps the flight recorder when signo is received, the dump is written right away by a helper thread
+void csl_logger_dump_on_signal(csl_logger_t *logger, int signo);
+
+typedef struct {
+    csl_logger_t *logger;
+    const LogHeader *end_header;
+    uint32_t id;
+} CslSpanScope;
+
+uint32_t csl_span_begin(csl_logger_t *logger, const LogHeader *header);
+void csl_span_end(csl_logger_t *logger, const LogHeader *header, uint32_t span_id);
+void csl_span_scope_end(CslSpanScope *scope);
+
+// Control rules enable or disable callsites at runtime, one rule per line:
+//   <on|off|default> [file=<glob>] [function=<glob>] [line=<n>] [id=<n>]
+// The last matching rule wins, "default" leaves the callsite to the level of the logger.
+// Both return the number of rules or -1 if the rules can't be parsed.
+int csl_control_apply(const char *rules);
+int csl_control_load(const char *path);
+// Reloads the rules from path whenever signo is received, the path is copied. The rules are loaded by a helper
+// thread, so they also take effect in an idle process and for callsites that are disabled until then.
+void csl_control_watch(const char *path, int signo);
+
 void csl_easy_init(const char *filename, LogLevel level);
 void csl_easy_end();
 void csl_log_call(const LogHeader *header, LoggingValueU *values);
@@ -0,0 +1,334 @@
+// Receives the batches of the CSL_SINK_SOCKET loggers of all processes of a host and appends them to rotated segment
+// files. The segments are synced with one policy for the whole host instead of one fsync per process and file.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "csl.h"
+
+constexpr size_t MAX_CLIENTS = 1024;
+constexpr uint64_t DEFAULT_SEGMENT_SIZE = 256 << 20;
+constexpr uint32_t DEFAULT_FSYNC_INTERVAL_MS = 1000;
+// Room for the process and the batch record in front of a received batch
+constexpr size_t BATCH_PREFIX_SIZE = CSL_PROCESS_RECORD_SIZE + CSL_BATCH_RECORD_SIZE;
+
+typedef enum: uint8_t {
+    FSYNC_NEVER,
+    // When a segment is complete
+    FSYNC_ROTATE,
+    // Every fsync_interval_ms if something was written, and when a segment is complete
+    FSYNC_INTERVAL,
+} FsyncPolicy;
+
+typedef struct {
+    int fd;
+    uint32_t pid;
+    // The first message of a connection is the file header of the logger with its build id
+    bool has_header;
+    char build_id[32];
+    // The process record is written once per segment, before the first batch of the client in it
+    uint32_t process_record_segment;
+    bool has_process_record;
+} Client;
+
+typedef struct {
+    const char *directory;
+    uint64_t max_size;
+    FsyncPolicy fsync_policy;
+    uint32_t fsync_interval_ms;
+
+    int fd;
+    uint32_t number;
+    uint64_t size;
+    // Written since the last fsync
+    bool dirty;
+} SegmentWriter;
+
+static volatile sig_atomic_t STOP_REQUESTED = 0;
+
+static void stop_signal_handler(int signo) {
+    (void)signo;
+    STOP_REQUESTED = 1;
+}
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool write_all(int fd, const char *data, size_t byte_count) {
+    while (byte_count > 0) {
+        ssize_t written = write(fd, data, byte_count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        byte_count -= written;
+    }
+    return true;
+}
+
+static void segment_sync(SegmentWriter *segment) {
+    if (segment->fd < 0 || !segment->dirty) return;
+    if (fdatasync(segment->fd) != 0) {
+        fprintf(stderr, "Syncing segment %u failed: %s\n", segment->number, strerror(errno));
+    }
+    segment->dirty = false;
+}
+
+static void segment_close(SegmentWriter *segment) {
+    if (segment->fd < 0) return;
+    if (segment->fsync_policy != FSYNC_NEVER) segment_sync(segment);
+    close(segment->fd);
+    segment->fd = -1;
+}
+
+// Segments are numbered, existing segments of an earlier run are never overwritten
+static bool segment_open_next(SegmentWriter *segment) {
+    segment_close(segment);
+
+    char name[4096];
+    while (true) {
+        segment->number += 1;
+        snprintf(name, sizeof name, "%s/segment_%06u.bin", segment->directory, segment->number);
+        segment->fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (segment->fd >= 0) break;
+        if (errno != EEXIST) {
+            fprintf(stderr, "Can't create segment %s: %s\n", name, strerror(errno));
+            return false;
+        }
+    }
+
+    // The processes of a segment come from different programs, their build ids are in the process records
+    char file_header[LOGGING_FILE_HEADER_SIZE] = {};
+    char *p = encode_binary_u32(file_header, LOGGING_FILE_HEADER_MAGIC_NUMBER);
+    encode_binary_u32(p, LOGGING_FILE_HEADER_VERSION_NUMBER);
+    if (!write_all(segment->fd, file_header, sizeof file_header)) return false;
+
+    segment->size = sizeof file_header;
+    segment->dirty = true;
+    printf("Writing segment %s\n", name);
+    return true;
+}
+
+static bool check_file_header(Client *client, const char *header, size_t byte_count) {
+    if (byte_count != LOGGING_FILE_HEADER_SIZE) return false;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    memcpy(&magic, header, sizeof magic);
+    memcpy(&version, header + 4, sizeof version);
+    memcpy(&flags, header + 40, sizeof flags);
+    // Compact streams can't be interleaved with the batches of other processes
+    if (magic != LOGGING_FILE_HEADER_MAGIC_NUMBER || version != LOGGING_FILE_HEADER_VERSION_NUMBER || flags != 0) {
+        return false;
+    }
+
+    memcpy(client->build_id, header + 8, sizeof client->build_id);
+    client->has_header = true;
+    return true;
+}
+
+// data points behind BATCH_PREFIX_SIZE free bytes, the batch is written with its records in front in one write
+static bool write_batch(SegmentWriter *segment, Client *client, char *data, size_t byte_count) {
+    bool needs_process_record = !client->has_process_record || client->process_record_segment != segment->number;
+    size_t needed = (needs_process_record ? CSL_PROCESS_RECORD_SIZE : 0) + CSL_BATCH_RECORD_SIZE + byte_count;
+
+    if (segment->fd < 0 || (segment->size + needed > segment->max_size && segment->size > LOGGING_FILE_HEADER_SIZE)) {
+        if (!segment_open_next(segment)) return false;
+        needs_process_record = true;
+        needed = CSL_PROCESS_RECORD_SIZE + CSL_BATCH_RECORD_SIZE + byte_count;
+    }
+
+    char *start = data - CSL_BATCH_RECORD_SIZE;
+    char *p = encode_binary_i32(start, CSL_RECORD_BATCH);
+    p = encode_binary_u32(p, client->pid);
+    encode_binary_u32(p, (uint32_t)byte_count);
+
+    if (needs_process_record) {
+        start -= CSL_PROCESS_RECORD_SIZE;
+        p = encode_binary_i32(start, CSL_RECORD_PROCESS);
+        p = encode_binary_u32(p, client->pid);
+        memcpy(p, client->build_id, sizeof client->build_id);
+        client->process_record_segment = segment->number;
+        client->has_process_record = true;
+    }
+
+    if (!write_all(segment->fd, start, needed)) {
+        fprintf(stderr, "Writing segment %u failed: %s\n", segment->number, strerror(errno));
+        return false;
+    }
+    segment->size += needed;
+    segment->dirty = true;
+    return true;
+}
+
+// Returns false if the client is gone or sent something that is not a batch of records
+static bool receive_batch(SegmentWriter *segment, Client *client, char *buffer) {
+    char *data = buffer + BATCH_PREFIX_SIZE;
+    ssize_t byte_count = recv(client->fd, data, CSL_COLLECTOR_MAX_BATCH_SIZE, MSG_TRUNC | MSG_DONTWAIT);
+    if (byte_count < 0) return errno == EINTR || errno == EAGAIN;
+    if (byte_count == 0) return false;
+
+    if ((size_t)byte_count > CSL_COLLECTOR_MAX_BATCH_SIZE) {
+        fprintf(stderr, "Process %u sent a batch of %zd bytes, more than %zu\n", client->pid, byte_count,
+                CSL_COLLECTOR_MAX_BATCH_SIZE);
+        return false;
+    }
+    if (!client->has_header) {
+        if (check_file_header(client, data, byte_count)) return true;
+        fprintf(stderr, "Process %u is not a CSL_SINK_SOCKET logger without the compact encoding\n", client->pid);
+        return false;
+    }
+
+    // A failed write loses the batch, the collector keeps serving the other processes
+    write_batch(segment, client, data, byte_count);
+    return true;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof address.sun_path) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // A socket left behind by a collector that did not exit cleanly
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof address) != 0 || listen(fd, 128) != 0) {
+        fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_client(int listen_fd, Client *clients, size_t *client_count) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    struct ucred credentials;
+    socklen_t length = sizeof credentials;
+    if (*client_count == MAX_CLIENTS || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+        close(fd);
+        return;
+    }
+    clients[(*client_count)++] = (Client) {.fd = fd, .pid = (uint32_t)credentials.pid};
+}
+
+static void print_help(char **argv) {
+    printf("Usage: %s --socket path --dir directory [--segment-size bytes] [--fsync never|rotate|ms]\n", argv[0]);
+    puts("  --socket is the name given to csl_logger_open by the CSL_SINK_SOCKET loggers");
+    puts("  --dir receives the segments segment_000001.bin, segment_000002.bin, ... they are converted by log_printer");
+    puts("  --segment-size starts a new segment when a segment would grow beyond it, default 256 MiB");
+    puts("  --fsync never leaves syncing to the kernel, rotate syncs complete segments,\n"
+         "          ms syncs the current segment every ms milliseconds as well, default 1000");
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = args_get_value("--socket", argc, argv);
+    const char *directory = args_get_value("--dir", argc, argv);
+    if (socket_path == nullptr || directory == nullptr || args_find_position("--help", argc, argv) > 0) {
+        print_help(argv);
+        return EXIT_FAILURE;
+    }
+
+    SegmentWriter segment = {
+        .directory = directory,
+        .max_size = DEFAULT_SEGMENT_SIZE,
+        .fsync_policy = FSYNC_INTERVAL,
+        .fsync_interval_ms = DEFAULT_FSYNC_INTERVAL_MS,
+        .fd = -1,
+    };
+    const char *segment_size_str = args_get_value("--segment-size", argc, argv);
+    if (segment_size_str != nullptr) segment.max_size = strtoull(segment_size_str, nullptr, 10);
+
+    const char *fsync_str = args_get_value("--fsync", argc, argv);
+    if (fsync_str != nullptr && strcmp(fsync_str, "never") == 0) {
+        segment.fsync_policy = FSYNC_NEVER;
+    } else if (fsync_str != nullptr && strcmp(fsync_str, "rotate") == 0) {
+        segment.fsync_policy = FSYNC_ROTATE;
+    } else if (fsync_str != nullptr) {
+        segment.fsync_interval_ms = (uint32_t)strtoul(fsync_str, nullptr, 10);
+        if (segment.fsync_interval_ms == 0) {
+            print_help(argv);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int listen_fd = listen_on(socket_path);
+    if (listen_fd < 0) return EXIT_FAILURE;
+
+    signal(SIGINT, stop_signal_handler);
+    signal(SIGTERM, stop_signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    Client *clients = calloc(MAX_CLIENTS, sizeof(clients[0]));
+    struct pollfd *fds = calloc(MAX_CLIENTS + 1, sizeof(fds[0]));
+    char *buffer = malloc(BATCH_PREFIX_SIZE + CSL_COLLECTOR_MAX_BATCH_SIZE);
+    size_t client_count = 0;
+    uint64_t last_sync_ms = monotonic_ms();
+
+    while (!STOP_REQUESTED) {
+        fds[0] = (struct pollfd) {.fd = listen_fd, .events = POLLIN};
+        for (size_t i = 0; i < client_count; ++i) {
+            fds[i + 1] = (struct pollfd) {.fd = clients[i].fd, .events = POLLIN};
+        }
+
+        int timeout = segment.fsync_policy == FSYNC_INTERVAL ? (int)segment.fsync_interval_ms : -1;
+        int ready = poll(fds, client_count + 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // Disconnected clients are replaced by the last one, the pollfds of this round keep their order
+        size_t polled_count = client_count;
+        for (size_t i = polled_count; ready > 0 && i-- > 0;) {
+            if (fds[i + 1].revents == 0) continue;
+            if (!receive_batch(&segment, &clients[i], buffer)) {
+                close(clients[i].fd);
+                clients[i] = clients[--client_count];
+            }
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN) != 0) accept_client(listen_fd, clients, &client_count);
+
+        if (segment.fsync_policy == FSYNC_INTERVAL && monotonic_ms() - last_sync_ms >= segment.fsync_interval_ms) {
+            segment_sync(&segment);
+            last_sync_ms = monotonic_ms();
+        }
+    }
+
+    // Batches the clients sent before the stop are still in the sockets
+    for (size_t i = 0; i < client_count; ++i) {
+        char peek;
+        while (recv(clients[i].fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) > 0 &&
+               receive_batch(&segment, &clients[i], buffer)) {}
+        close(clients[i].fd);
+    }
+
+    segment_close(&segment);
+    close(listen_fd);
+    unlink(socket_path);
+    free(buffer);
+    free(fds);
+    free(clients);
+    return EXIT_SUCCESS;
+}
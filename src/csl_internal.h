@@ -0,0 +1,56 @@
+#pragma once
+#include "csl.h"
+
+// Shared between the translation units of the logging library, not part of the public api
+
+// The cached id of the callsite, computed if the callsite is not registered yet
+int64_t csl_callsite_id(LogHeader *header);
+// Number of images with registered callsites, it only grows
+extern uint32_t CSL_MODULE_COUNT;
+// Writes the fields of the module record of an image after the record id, CSL_MODULE_RECORD_SIZE - 4 bytes
+char *callsite_encode_module(char *p, uint32_t index);
+
+// Copies the build id of the image that contains address into the 32 bytes at build_id, zero padded, and returns its
+// size, 0 if the image has none
+size_t callsite_image_build_id(const void *address, char *build_id);
+// Evaluates a callsite the first time it is logged and remembers it for later reevaluation
+CallsiteState callsite_register(LogHeader *header);
+// Loggers report their level changes, old or new level is LL_COUNT for a closed/opened logger
+void callsite_track_level(LogLevel old_level, LogLevel new_level);
+
+// Runs callback on a helper thread whenever signo is received, also while no message is logged
+typedef void (*SignalCallback)(int signo);
+bool signal_thread_watch(int signo, SignalCallback callback);
+
+typedef struct ShmRing ShmRing;
+ShmRing *shm_ring_create(const char *name, size_t capacity, const char *file_header);
+void shm_ring_write(ShmRing *ring, const char *data, size_t byte_count);
+void shm_ring_close(ShmRing *ring);
+
+typedef struct UringWriter UringWriter;
+// compact selects the padding record of CSL_FILE_FLAG_COMPACT streams
+UringWriter *uring_writer_create(const char *filename, size_t buffer_size, size_t buffer_count, bool direct,
+                                 bool compact);
+void uring_writer_write(UringWriter *w, const char *data, size_t byte_count);
+void uring_writer_flush(UringWriter *w);
+void uring_writer_close(UringWriter *w);
+
+typedef struct AppendWriter AppendWriter;
+AppendWriter *append_writer_create(const char *filename, size_t buffer_size, const char *file_header);
+void append_writer_write(AppendWriter *w, const char *data, size_t byte_count);
+void append_writer_flush(AppendWriter *w);
+void append_writer_close(AppendWriter *w);
+
+typedef struct FlightRecorder FlightRecorder;
+FlightRecorder *flight_recorder_create(const char *name, size_t capacity, const char *file_header);
+void flight_recorder_write(FlightRecorder *recorder, const char *data, size_t byte_count);
+bool flight_recorder_dump(FlightRecorder *recorder, const char *filename);
+void flight_recorder_close(FlightRecorder *recorder);
+
+typedef struct SocketWriter SocketWriter;
+// Batches are limited to CSL_COLLECTOR_MAX_BATCH_SIZE, buffer_count batches are kept while the collector is away
+SocketWriter *socket_writer_create(const char *path, size_t buffer_size, size_t buffer_count,
+                                   const char *file_header);
+void socket_writer_write(SocketWriter *w, const char *data, size_t byte_count);
+void socket_writer_flush(SocketWriter *w);
+void socket_writer_close(SocketWriter *w);
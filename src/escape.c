@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ESCAPE_X86
+#endif
+
+#include "log_printer.h"
+
+// Writes the replacement for c into out and returns its length, 0 if c can be copied as is.
+static size_t escape_byte(EscapeMode mode, unsigned char c, char out[static 8]) {
+    const char *replacement = nullptr;
+
+    switch (mode) {
+        case ESCAPE_JSON:
+            switch (c) {
+                case '"':  replacement = "\\\""; break;
+                case '\\': replacement = "\\\\"; break;
+                case '\b': replacement = "\\b"; break;
+                case '\f': replacement = "\\f"; break;
+                case '\n': replacement = "\\n"; break;
+                case '\r': replacement = "\\r"; break;
+                case '\t': replacement = "\\t"; break;
+                default:
+                    if (c >= 0x20) return 0;
+                    return (size_t)snprintf(out, 8, "\\u%04x", c);
+            }
+            break;
+        case ESCAPE_XML:
+            switch (c) {
+                case '&':  replacement = "&amp;"; break;
+                case '<':  replacement = "&lt;"; break;
+                case '>':  replacement = "&gt;"; break;
+                case '"':  replacement = "&quot;"; break;
+                case '\'': replacement = "&#39;"; break;
+                case '\t':
+                case '\n':
+                case '\r':
+                    return 0;
+                default:
+                    // XML 1.0 does not allow the remaining control characters, not even as references
+                    if (c >= 0x20) return 0;
+                    replacement = "&#xFFFD;";
+            }
+            break;
+        case ESCAPE_COUNT:
+            unreachable();
+    }
+
+    size_t length = strlen(replacement);
+    memcpy(out, replacement, length);
+    return length;
+}
+
+static bool escape_candidate(EscapeMode mode, unsigned char c) {
+    switch (mode) {
+        case ESCAPE_JSON:
+            return c == '"' || c == '\\' || c < 0x20;
+        case ESCAPE_XML:
+            return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'' || c < 0x20;
+        case ESCAPE_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+static size_t escape_find_scalar(EscapeMode mode, const char *s, size_t n, size_t start) {
+    for (size_t i = start; i < n; ++i) {
+        if (escape_candidate(mode, (unsigned char)s[i])) return i;
+    }
+    return n;
+}
+
+#ifdef ESCAPE_X86
+// The SIMD scanners only find candidates, escape_byte decides what really gets replaced.
+static inline __m128i escape_mask_sse2(EscapeMode mode, __m128i v) {
+    __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))));
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+
+    switch (mode) {
+        case ESCAPE_JSON:
+            return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                                control);
+        case ESCAPE_XML:
+            special = _mm_or_si128(special, control);
+            return _mm_or_si128(special, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))));
+        case ESCAPE_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+static size_t escape_find_sse2(EscapeMode mode, const char *s, size_t n, size_t start) {
+    size_t i = start;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(escape_mask_sse2(mode, v));
+        if (mask != 0) return i + (size_t)__builtin_ctz(mask);
+    }
+    return escape_find_scalar(mode, s, n, i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i escape_mask_avx2(EscapeMode mode, __m256i v) {
+    __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))));
+    __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+
+    switch (mode) {
+        case ESCAPE_JSON:
+            return _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                                   _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                                   control);
+        case ESCAPE_XML:
+            special = _mm256_or_si256(special, control);
+            return _mm256_or_si256(special, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+                                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>'))));
+        case ESCAPE_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+__attribute__((target("avx2")))
+static size_t escape_find_avx2(EscapeMode mode, const char *s, size_t n, size_t start) {
+    size_t i = start;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(escape_mask_avx2(mode, v));
+        if (mask != 0) return i + (size_t)__builtin_ctz(mask);
+    }
+    return escape_find_sse2(mode, s, n, i);
+}
+#endif
+
+size_t escape_find(EscapeMode mode, const char *s, size_t n, size_t start) {
+#ifdef ESCAPE_X86
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2");
+
+    if (has_avx2) return escape_find_avx2(mode, s, n, start);
+    return escape_find_sse2(mode, s, n, start);
+#else
+    return escape_find_scalar(mode, s, n, start);
+#endif
+}
+
+void escape_write(FILE *f, EscapeMode mode, const char *s, size_t n) {
+    size_t last_start = 0;
+    size_t i = 0;
+
+    while ((i = escape_find(mode, s, n, i)) < n) {
+        char replacement[8];
+        size_t length = escape_byte(mode, (unsigned char)s[i], replacement);
+        i += 1;
+        if (length == 0) continue;
+
+        fwrite(s + last_start, 1, i - 1 - last_start, f);
+        fwrite(replacement, 1, length, f);
+        last_start = i;
+    }
+
+    fwrite(s + last_start, 1, n - last_start, f);
+}
+
+StringView escape_string_view(EscapeMode mode, StringView sv) {
+    char *data = nullptr;
+    size_t size = 0;
+
+    FILE *f = open_memstream(&data, &size);
+    if (f == nullptr) {
+        printf("Unexpected allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sv.data != nullptr) escape_write(f, mode, sv.data, sv.byte_count);
+    fclose(f);
+
+    return (StringView) {.byte_count = size, .data = data};
+}
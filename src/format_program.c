@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "log_printer.h"
+
+static bool format_error(char *error, size_t error_size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(error, error_size, fmt, args);
+    va_end(args);
+    return false;
+}
+
+static void format_program_append(FormatProgram *program, FormatSegment segment) {
+    if (segment.kind == SEGMENT_LITERAL && segment.length == 0) return;
+
+    FormatSegment *new_segments = realloc(program->segments, (program->count + 1) * sizeof(program->segments[0]));
+    if (new_segments == nullptr) {
+        printf("Unexpected allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    program->segments = new_segments;
+    program->segments[program->count] = segment;
+    program->count += 1;
+}
+
+DataType data_type_element(DataType type) {
+    switch (type) {
+        case TYPE_U8_ARRAY:
+        case TYPE_BLOB:         return TYPE_U8;
+        case TYPE_U32_ARRAY:    return TYPE_U32;
+        case TYPE_I32_ARRAY:    return TYPE_I32;
+        case TYPE_F32_ARRAY:    return TYPE_F32;
+        case TYPE_U8:
+        case TYPE_U32:
+        case TYPE_I32:
+        case TYPE_F32:
+        case TYPE_CSTRING:      return type;
+        case TYPE_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+LoggingValueU logging_array_element(DataType type, LoggingArray array, size_t index) {
+    LoggingValueU value = {};
+    size_t size = DATA_TYPE_ELEMENT_SIZES[type];
+    memcpy(&value, (const char *)array.data + index * size, size);
+    return value;
+}
+
+static bool conversion_allowed(DataType type, char conversion) {
+    // Array elements take the conversions of their scalar type
+    type = data_type_element(type);
+    switch (type) {
+        case TYPE_U8:
+            return strchr("dxXoc", conversion) != nullptr;
+        case TYPE_U32:
+        case TYPE_I32:
+            return strchr("dxXo", conversion) != nullptr;
+        case TYPE_F32:
+            return strchr("fFeEgG", conversion) != nullptr;
+        case TYPE_CSTRING:
+            return conversion == 's';
+        case TYPE_U8_ARRAY:
+        case TYPE_U32_ARRAY:
+        case TYPE_I32_ARRAY:
+        case TYPE_F32_ARRAY:
+        case TYPE_BLOB:
+        case TYPE_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+static char default_conversion(DataType type) {
+    switch (type) {
+        case TYPE_U8:
+        case TYPE_U32:
+        case TYPE_I32:
+        case TYPE_U8_ARRAY:
+        case TYPE_U32_ARRAY:
+        case TYPE_I32_ARRAY:    return 'd';
+        case TYPE_F32:
+        case TYPE_F32_ARRAY:    return 'f';
+        case TYPE_CSTRING:      return 's';
+        case TYPE_BLOB:         return 'x';
+        case TYPE_COUNT:
+            unreachable();
+    }
+    unreachable();
+}
+
+// Translates the spec between ':' and '}' ([<|>][0][width][.precision][type]) into a printf conversion
+static bool compile_spec(FormatSegment *segment, DataType type, const char *spec, size_t length,
+                         char *error, size_t error_size) {
+    char flags[3] = {};
+    size_t flag_count = 0;
+    size_t i = 0;
+
+    if (i < length && (spec[i] == '<' || spec[i] == '>')) {
+        if (spec[i] == '<') flags[flag_count++] = '-';
+        i += 1;
+    }
+    if (i < length && spec[i] == '0') {
+        flags[flag_count++] = '0';
+        i += 1;
+    }
+
+    int width = -1;
+    while (i < length && spec[i] >= '0' && spec[i] <= '9') {
+        width = (width < 0 ? 0 : width * 10) + (spec[i] - '0');
+        i += 1;
+        if (width > 999) return format_error(error, error_size, "width too large");
+    }
+    // Blob bytes are printed as two hex digits each unless the spec sets a width
+    if (type == TYPE_BLOB && width < 0 && flag_count == 0) {
+        flags[flag_count++] = '0';
+        width = 2;
+    }
+
+    int precision = -1;
+    if (i < length && spec[i] == '.') {
+        i += 1;
+        precision = 0;
+        if (i >= length || spec[i] < '0' || spec[i] > '9') return format_error(error, error_size, "missing precision");
+        while (i < length && spec[i] >= '0' && spec[i] <= '9') {
+            precision = precision * 10 + (spec[i] - '0');
+            i += 1;
+            if (precision > 999) return format_error(error, error_size, "precision too large");
+        }
+    }
+
+    char conversion = default_conversion(type);
+    if (i < length) conversion = spec[i++];
+
+    if (i != length) return format_error(error, error_size, "unexpected '%c' in format spec", spec[i]);
+    if (!conversion_allowed(type, conversion)) {
+        return format_error(error, error_size, "conversion '%c' is not valid for %s argument %u",
+                            conversion, DATA_TYPE_NAMES[type].data, segment->arg);
+    }
+    DataType element = data_type_element(type);
+    if (precision >= 0 && (element == TYPE_U8 || element == TYPE_U32 || element == TYPE_I32)) {
+        return format_error(error, error_size, "precision is not valid for %s argument %u",
+                            DATA_TYPE_NAMES[type].data, segment->arg);
+    }
+
+    // Integers are printed from their unsigned representation except for a decimal i32
+    if (conversion == 'd' && element != TYPE_I32) conversion = 'u';
+
+    char width_str[4] = {};
+    char precision_str[5] = {};
+    if (width >= 0)     snprintf(width_str, sizeof width_str, "%d", width % 1000);
+    if (precision >= 0) snprintf(precision_str, sizeof precision_str, ".%d", precision % 1000);
+
+    snprintf(segment->spec, sizeof segment->spec, "%%%s%s%s%c", flags, width_str, precision_str, conversion);
+    return true;
+}
+
+bool format_program_compile(FormatProgram *program, const LogHeader *header, char *error, size_t error_size) {
+    *program = (FormatProgram) {};
+
+    const char *fmt = header->fmt_str.data;
+    size_t length = header->fmt_str.byte_count;
+    size_t last_start = 0;
+    size_t current_arg = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        if (fmt[i] == '}') {
+            if (i + 1 >= length || fmt[i + 1] != '}') {
+                return format_error(error, error_size, "unmatched '}' at position %zu", i);
+            }
+            // keep the first brace as part of the literal and skip the second one
+            format_program_append(program, (FormatSegment) {
+                .kind = SEGMENT_LITERAL, .offset = last_start, .length = i + 1 - last_start
+            });
+            i += 1;
+            last_start = i + 1;
+            continue;
+        }
+
+        if (fmt[i] != '{') continue;
+
+        if (i + 1 < length && fmt[i + 1] == '{') {
+            format_program_append(program, (FormatSegment) {
+                .kind = SEGMENT_LITERAL, .offset = last_start, .length = i + 1 - last_start
+            });
+            i += 1;
+            last_start = i + 1;
+            continue;
+        }
+
+        const char *close = memchr(fmt + i, '}', length - i);
+        if (close == nullptr) return format_error(error, error_size, "unterminated '{' at position %zu", i);
+
+        if (current_arg >= header->arg_count) {
+            return format_error(error, error_size, "more placeholders than the %zu arguments", header->arg_count);
+        }
+
+        format_program_append(program, (FormatSegment) {
+            .kind = SEGMENT_LITERAL, .offset = last_start, .length = i - last_start
+        });
+
+        FormatSegment segment = {.kind = SEGMENT_ARG, .arg = current_arg};
+        const char *spec = fmt + i + 1;
+        size_t spec_length = close - spec;
+
+        if (spec_length > 0 && spec[0] != ':') {
+            return format_error(error, error_size, "expected ':' before the format spec at position %zu", i + 1);
+        }
+        if (spec_length > 0) {
+            spec += 1;
+            spec_length -= 1;
+        }
+        if (!compile_spec(&segment, header->types[current_arg], spec, spec_length, error, error_size)) {
+            return false;
+        }
+
+        format_program_append(program, segment);
+        current_arg += 1;
+        i = close - fmt;
+        last_start = i + 1;
+    }
+
+    format_program_append(program, (FormatSegment) {
+        .kind = SEGMENT_LITERAL, .offset = last_start, .length = length - last_start
+    });
+
+    if (current_arg != header->arg_count) {
+        return format_error(error, error_size, "%zu placeholders for %zu arguments", current_arg, header->arg_count);
+    }
+
+    program->valid = true;
+    return true;
+}
+
+void format_program_free(FormatProgram *program) {
+    free(program->segments);
+    *program = (FormatProgram) {};
+}
+
+static void format_value(FILE *f, const char *spec, DataType type, LoggingValueU value) {
+    switch (type) {
+        case TYPE_U8:       fprintf(f, spec, value.val_uint8); break;
+        case TYPE_U32:      fprintf(f, spec, value.val_uint); break;
+        case TYPE_I32:      fprintf(f, spec, value.val_int); break;
+        case TYPE_F32:      fprintf(f, spec, value.val_float); break;
+        case TYPE_CSTRING:  fprintf(f, spec, value.val_cstring); break;
+        case TYPE_BLOB:
+            for (size_t i = 0; i < value.val_array.count; ++i) {
+                format_value(f, spec, TYPE_U8, logging_array_element(type, value.val_array, i));
+            }
+            break;
+        // The spec applies to each element: [1, 2, 3]
+        case TYPE_U8_ARRAY:
+        case TYPE_U32_ARRAY:
+        case TYPE_I32_ARRAY:
+        case TYPE_F32_ARRAY:
+            fputc('[', f);
+            for (size_t i = 0; i < value.val_array.count; ++i) {
+                if (i > 0) fputs(", ", f);
+                format_value(f, spec, data_type_element(type), logging_array_element(type, value.val_array, i));
+            }
+            fputc(']', f);
+            break;
+        case TYPE_COUNT:
+            unreachable();
+    }
+}
+
+void format_program_run(FILE *f, const FormatProgram *program, const LogHeader *header, LoggingValueU *values) {
+    if (!program->valid) {
+        // Keep the information of broken format strings by printing the raw string and all arguments
+        fwrite(header->fmt_str.data, 1, header->fmt_str.byte_count, f);
+        for (size_t i = 0; i < header->arg_count; ++i) {
+            fputs(i == 0 ? " <- " : ", ", f);
+            FormatSegment segment = {.arg = i};
+            compile_spec(&segment, header->types[i], "", 0, nullptr, 0);
+            format_value(f, segment.spec, header->types[i], values[i]);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < program->count; ++i) {
+        const FormatSegment *segment = &program->segments[i];
+
+        switch (segment->kind) {
+            case SEGMENT_LITERAL:
+                fwrite(header->fmt_str.data + segment->offset, 1, segment->length, f);
+                break;
+            case SEGMENT_ARG:
+                format_value(f, segment->spec, header->types[segment->arg], values[segment->arg]);
+                break;
+        }
+    }
+}
@@ -0,0 +1,197 @@
+#include "csl.h"
+
+// Viewer page of the html format. log_printer writes the head, a script that sets CSL_DATA_DIR and the body parts.
+// The body loads CSL_DATA_DIR/index.js, which calls csl_index_start, csl_index_page for every page and csl_index_done,
+// and then the pages of the visible rows, each a call of csl_page(n, [[timestamp, level, location, message], ...]).
+// The body is split to keep every string literal below the 4095 characters that ISO C requires compilers to support.
+
+const StringView HTML_VIEWER_HEAD = SV(
+        "<!DOCTYPE html>\n"
+        "<html>\n"
+        "<head>\n"
+        "<meta charset=\"utf-8\">\n"
+        "<title>Log</title>\n"
+        "<style>\n"
+        "body { margin: 0; font: 13px monospace; display: flex; flex-direction: column; height: 100vh; }\n"
+        "#bar { padding: 4px 8px; background: #eee; border-bottom: 1px solid #ccc; display: flex; gap: 12px; align-items: center; flex-wrap: wrap; }\n"
+        "#scroller { flex: 1; overflow-y: auto; position: relative; }\n"
+        "#rows { position: sticky; top: 0; }\n"
+        ".row { height: 20px; line-height: 20px; white-space: pre; overflow: hidden; text-overflow: ellipsis; display: flex; gap: 8px; padding: 0 8px; }\n"
+        ".row span { flex: none; }\n"
+        ".row .msg { flex: 1; overflow: hidden; text-overflow: ellipsis; }\n"
+        ".row:nth-child(odd) { background: #f8f8f8; }\n"
+        ".level-3 { color: #a60; } .level-4, .level-5, .level-6 { color: #c00; font-weight: bold; }\n"
+        ".loading { color: #999; }\n"
+        "</style>\n"
+        "</head>\n"
+        "<body>\n");
+
+const StringView HTML_VIEWER_BODY[] = {
+        SV(
+                "<div id=\"bar\">\n"
+                "  <span id=\"summary\">Loading index...</span>\n"
+                "  <label>Timestamp <input id=\"goto-time\" size=\"12\"></label>\n"
+                "  <button id=\"prev-problem\">&uarr; warning</button>\n"
+                "  <button id=\"next-problem\">&darr; warning</button>\n"
+                "  <span id=\"page-info\"></span>\n"
+                "</div>\n"
+                "<div id=\"scroller\"><div id=\"rows\"></div><div id=\"spacer\"></div></div>\n"
+                "<script>\n"
+                "\"use strict\";\n"
+                "const ROW_HEIGHT = 20;\n"
+                "// Browsers limit the height of an element, longer logs map the scroll position to rows proportionally\n"
+                "const MAX_SCROLL_HEIGHT = 8000000;\n"
+                "const MAX_CACHED_PAGES = 32;\n"
+                "const WARNING_LEVEL = 3;\n"
+                "\n"
+                "let pageSize = 0;\n"
+                "let levelNames = [];\n"
+                "const pages = [];\n"
+                "const pageStarts = [];\n"
+                "let total = 0;\n"
+                "const cache = new Map();\n"
+                "const requested = new Set();\n"
+                "\n"
+                "const scroller = document.getElementById(\"scroller\");\n"
+                "const rows = document.getElementById(\"rows\");\n"
+                "const spacer = document.getElementById(\"spacer\");\n"
+                "\n"
+                "function csl_index_start(size, names) {\n"
+                "    pageSize = size;\n"
+                "    levelNames = names;\n"
+                "}\n"
+                "\n"
+                "function csl_index_page(n, firstTimestamp, lastTimestamp, rowCount, levelCounts) {\n"
+                "    pages[n] = {first: firstTimestamp, last: lastTimestamp, rows: rowCount, levels: levelCounts};\n"
+                "    pageStarts[n] = total;\n"
+                "    total += rowCount;\n"
+                "}\n"
+                "\n"
+                "function csl_index_done() {\n"
+                "    const counts = levelNames.map((_, level) => pages.reduce((sum, page) => sum + page.levels[level], 0));\n"
+                "    const levels = levelNames.map((name, level) => counts[level] > 0 ? name + \" \" + counts[level] : \"\").filter(s => s);\n"
+                "    document.getElementById(\"summary\").textContent = total + \" messages in \" + pages.length + \" pages: \" + levels.join(\", \");\n"
+                "    layout();\n"
+                "}\n"
+                "\n"
+                "function csl_page(n, pageRows) {\n"
+                "    requested.delete(n);\n"
+                "    cache.set(n, pageRows);\n"
+                "    while (cache.size > MAX_CACHED_PAGES) cache.delete(cache.keys().next().value);\n"
+                "    render();\n"
+                "}\n"
+                "\n"
+                "function requestPage(n) {\n"
+                "    if (n < 0 || n >= pages.length || cache.has(n) || requested.has(n)) return;\n"
+                "    requested.add(n);\n"
+                "    const script = document.createElement(\"script\");\n"
+                "    script.src = CSL_DATA_DIR + \"page_\" + String(n).padStart(6, \"0\") + \".js\";\n"
+                "    script.onload = script.onerror = () => script.remove();\n"
+                "    document.head.appendChild(script);\n"
+                "}\n"
+                "\n"
+                "function visibleCount() {\n"
+                "    return Math.ceil(scroller.clientHeight / ROW_HEIGHT) + 1;\n"
+                "}\n"
+                "\n"
+                "function scrollHeight() {\n"
+                "    return Math.min(total * ROW_HEIGHT, MAX_SCROLL_HEIGHT);\n"
+                "}\n"
+                "\n"
+                "function layout() {\n"
+                "    spacer.style.height = Math.max(0, scrollHeight() - scroller.clientHeight) + \"px\";\n"
+                "    render();\n"
+                "}\n"
+                "\n"
+                "function firstRow() {\n"
+                "    const maxFirst = Math.max(0, total - visibleCount() + 1);\n"
+                "    const range = Math.max(1, scrollHeight() - scroller.clientHeight);\n"
+                "    return Math.min(maxFirst, Math.floor(scroller.scrollTop / range * maxFirst));\n"
+                "}\n"
+                "\n"
+                "function scrollToRow(row) {\n"
+                "    const maxFirst = Math.max(1, total - visibleCount() + 1);\n"
+                "    scroller.scrollTop = Math.min(row, maxFirst) / maxFirst * Math.max(1, scrollHeight() - scroller.clientHeight);\n"
+                "}\n"
+                "\n"
+                "function pageOfRow(row) {\n"
+                "    return Math.floor(row / pageSize);\n"
+                "}\n"
+                "\n"
+                "function render() {\n"
+                "    const first = firstRow();\n"
+                "    const count = Math.min(visibleCount(), total - first);\n"
+                "    const elements = [];\n"
+                "\n"
+                "    for (let i = first; i < first + count; ++i) {\n"
+                "        const n = pageOfRow(i);\n"
+                "        const page = cache.get(n);\n"
+                "        const element = document.createElement(\"div\");\n"
+                "        element.className = \"row\";\n"
+                "\n"
+                "        if (page === undefined) {\n"
+                "            requestPage(n);\n"
+                "            element.classList.add(\"loading\");\n"
+                "            element.textContent = (i + 1) + \" ...\";\n"
+                "        } else {\n"),
+        SV(
+                "            cache.delete(n);\n"
+                "            cache.set(n, page);\n"
+                "            const [timestamp, level, location, message] = page[i - pageStarts[n]];\n"
+                "            element.classList.add(\"level-\" + level);\n"
+                "            for (const [text, className] of [[i + 1, \"\"], [levelNames[level], \"\"], [timestamp, \"\"], [location, \"\"], [message, \"msg\"]]) {\n"
+                "                const cell = document.createElement(\"span\");\n"
+                "                cell.textContent = text;\n"
+                "                if (className) cell.className = className;\n"
+                "                element.appendChild(cell);\n"
+                "            }\n"
+                "        }\n"
+                "        elements.push(element);\n"
+                "    }\n"
+                "    rows.replaceChildren(...elements);\n"
+                "\n"
+                "    // Loads the next page early, so scrolling down rarely shows placeholders\n"
+                "    const last = first + count - 1;\n"
+                "    if (count > 0 && last - pageStarts[pageOfRow(last)] > pageSize / 2) requestPage(pageOfRow(last) + 1);\n"
+                "\n"
+                "    const n = pageOfRow(first);\n"
+                "    if (pages[n] !== undefined) {\n"
+                "        document.getElementById(\"page-info\").textContent =\n"
+                "            \"page \" + (n + 1) + \"/\" + pages.length + \", timestamps \" + pages[n].first + \" - \" + pages[n].last;\n"
+                "    }\n"
+                "}\n"
+                "\n"
+                "// Pages with a message at or above WARNING, found by the level counts of the index\n"
+                "function findProblemPage(from, step) {\n"
+                "    for (let n = from; n >= 0 && n < pages.length; n += step) {\n"
+                "        if (pages[n].levels.slice(WARNING_LEVEL).some(count => count > 0)) return n;\n"
+                "    }\n"
+                "    return -1;\n"
+                "}\n"
+                "\n"
+                "function jumpToProblem(step) {\n"
+                "    const current = pageOfRow(firstRow());\n"
+                "    const n = findProblemPage(current + step, step);\n"
+                "    if (n >= 0) scrollToRow(pageStarts[n]);\n"
+                "}\n"
+                "\n"
+                "document.getElementById(\"next-problem\").onclick = () => jumpToProblem(1);\n"
+                "document.getElementById(\"prev-problem\").onclick = () => jumpToProblem(-1);\n"
+                "document.getElementById(\"goto-time\").onchange = event => {\n"
+                "    const timestamp = Number(event.target.value);\n"
+                "    const n = pages.findIndex(page => page.last >= timestamp);\n"
+                "    if (n >= 0) scrollToRow(pageStarts[n]);\n"
+                "};\n"
+                "\n"
+                "scroller.addEventListener(\"scroll\", () => requestAnimationFrame(render));\n"
+                "window.addEventListener(\"resize\", layout);\n"
+                "\n"
+                "const indexScript = document.createElement(\"script\");\n"
+                "indexScript.src = CSL_DATA_DIR + \"index.js\";\n"
+                "indexScript.onerror = () => document.getElementById(\"summary\").textContent = \"Can't load \" + indexScript.src;\n"
+                "document.head.appendChild(indexScript);\n"
+                "</script>\n"
+                "</body>\n"
+                "</html>\n"),
+};
+const size_t HTML_VIEWER_BODY_COUNT = sizeof HTML_VIEWER_BODY / sizeof HTML_VIEWER_BODY[0];
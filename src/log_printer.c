@@ -2,11 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <time.h>
 
 #include <elf.h>
 
@@ -15,32 +19,50 @@
 #endif
 
 #include "csl.h"
+#include "log_printer.h"
 
-extern const StringView HTML_TABLE_START;
-extern const StringView HTML_TABLE_END;
+extern const StringView HTML_VIEWER_HEAD;
+extern const StringView HTML_VIEWER_BODY[];
+extern const size_t HTML_VIEWER_BODY_COUNT;
+
+typedef struct {
+    StringView fmt_str;
+    StringView filename;
+    StringView function;
+} EscapedHeader;
 
 typedef struct {
     size_t size;
     size_t capacity;
     LogHeader **headers;
-    uint32_t *ids;
-    size_t sentinel_index;
+    int64_t *ids;
+    EscapedHeader *escaped;
+    FormatProgram *programs;
+    // First of the LL_COUNT headers of the repeat records, one per level of the repeated message
+    size_t repeat_index;
+    // Header index + 1 by callsite index, open addressing with a power of two slot count, 0 marks a free slot
+    size_t slot_count;
+    uint32_t *slots;
 } HeaderList;
 
 void header_list_init(HeaderList *list) {
-    list->sentinel_index = 0;
+    list->repeat_index = 0;
     list->size = 0;
     list->capacity = 1;
     list->headers = malloc(list->capacity * sizeof(list->headers[0]));
     list->ids = malloc(list->capacity * sizeof(list->ids[0]));
+    list->escaped = nullptr;
+    list->programs = nullptr;
+    list->slot_count = 0;
+    list->slots = nullptr;
 }
 
-void header_list_append(HeaderList *list, LogHeader *header) {
+void header_list_append(HeaderList *list, LogHeader *header, int64_t id) {
     if (list->size == list->capacity) {
         list->capacity *= 2;
 
         LogHeader **new_headers = realloc(list->headers, list->capacity * sizeof(list->headers[0]));
-        uint32_t *new_ids =  realloc(list->ids, list->capacity * sizeof(list->ids[0]));
+        int64_t *new_ids =  realloc(list->ids, list->capacity * sizeof(list->ids[0]));
 
         if (new_headers == nullptr || new_ids == nullptr) {
             printf("Unexpected allocation error\n");
@@ -51,40 +73,70 @@ void header_list_append(HeaderList *list, LogHeader *header) {
         list->ids = new_ids;
     }
     list->headers[list->size] = header;
-    list->ids[list->size] = 0;
+    list->ids[list->size] = id;
+    list->size += 1;
+}
 
-    if (header->category == '~') {
-        list->sentinel_index = list->size;
+static size_t header_list_slot(const HeaderList *list, uint32_t callsite_index) {
+    uint32_t h = callsite_index * 0x9e3779b1u;
+    h ^= h >> 16;
+
+    size_t slot = h & (list->slot_count - 1);
+    while (list->slots[slot] != 0 && csl_callsite_id_index(list->ids[list->slots[slot] - 1]) != callsite_index) {
+        slot = (slot + 1) & (list->slot_count - 1);
     }
+    return slot;
+}
 
-    list->size += 1;
+// Indexes the callsites of the program, the repeat headers have no callsite index and are left out
+void header_list_index(HeaderList *list) {
+    list->slot_count = 16;
+    while (list->slot_count < 2 * list->size) list->slot_count *= 2;
+    list->slots = calloc(list->slot_count, sizeof(list->slots[0]));
+
+    size_t callsite_count = list->repeat_index != 0 ? list->repeat_index : list->size;
+    for (size_t i = 0; i < callsite_count; ++i) {
+        list->slots[header_list_slot(list, csl_callsite_id_index(list->ids[i]))] = (uint32_t)i + 1;
+    }
+}
+
+uint32_t header_list_lookup(const HeaderList *list, uint32_t callsite_index) {
+    if (list->slot_count == 0) return UINT32_MAX;
+    uint32_t slot = list->slots[header_list_slot(list, callsite_index)];
+    return slot == 0 ? UINT32_MAX : slot - 1;
 }
 
-uint32_t header_list_lookup_by_id(HeaderList *list, uint32_t id) {
+void header_list_free_escaped(HeaderList *list) {
+    if (list->escaped == nullptr) return;
+
     for (size_t i = 0; i < list->size; ++i) {
-        if (list->ids[i] == id) return i;
+        free((char *)list->escaped[i].fmt_str.data);
+        free((char *)list->escaped[i].filename.data);
+        free((char *)list->escaped[i].function.data);
     }
-    return UINT32_MAX;
+    free(list->escaped);
+    list->escaped = nullptr;
 }
 
 void header_list_free(HeaderList *list) {
+    header_list_free_escaped(list);
+    if (list->programs != nullptr) {
+        for (size_t i = 0; i < list->size; ++i) format_program_free(&list->programs[i]);
+        free(list->programs);
+        list->programs = nullptr;
+    }
     free(list->headers);
     free(list->ids);
+    free(list->slots);
 
     list->headers = nullptr;
     list->ids = nullptr;
+    list->slots = nullptr;
 
     list->size = 0;
     list->capacity = 0;
-    list->sentinel_index = 0;
-}
-
-void header_list_fill_ids(HeaderList *list) {
-    LogHeader *sentinel = list->headers[list->sentinel_index];
-
-    for (size_t i = 0; i < list->size; ++i) {
-        list->ids[i] = (int32_t)((char *) list->headers[i] - (char *)sentinel);
-    }
+    list->slot_count = 0;
+    list->repeat_index = 0;
 }
 
 static void fix_string(const char **broken_string, const char *file_content) {
@@ -103,6 +155,132 @@ void header_list_fix_string(HeaderList *list, const char * file_content) {
     }
 }
 
+// Repeat records of coalescing loggers are converted as a message of these headers, with the location of the
+// repeated callsite, the number of repetitions and the timestamp of the first one as arguments. Each level has its own
+// id in the reserved CSL_RECORD_REPEAT module, the meta data of formats like sqlite is per id.
+static LogHeader REPEAT_HEADERS[LL_COUNT];
+
+void header_list_append_repeats(HeaderList *list) {
+    list->repeat_index = list->size;
+    for (int level = 0; level < LL_COUNT; ++level) {
+        REPEAT_HEADERS[level] = (LogHeader) {
+            .fmt_str = SV("message of {} repeated {} times since {}"),
+            .arg_count = 3,
+            .types = {TYPE_CSTRING, TYPE_U32, TYPE_U32},
+            .filename = SV("<repeat>"),
+            .function = SV("<repeat>"),
+            .level = level,
+        };
+        header_list_append(list, &REPEAT_HEADERS[level], csl_callsite_id_make(CSL_RECORD_REPEAT, (uint32_t)level));
+    }
+}
+
+// Span records of CSL_SPAN_BEGIN/CSL_SPAN_END carry the span name as fmt_str and no placeholders
+static bool is_span_header(const LogHeader *h) {
+    if (h->category != CSL_CATEGORY_SPAN_BEGIN && h->category != CSL_CATEGORY_SPAN_END) return false;
+    return h->arg_count == 3 && h->types[0] == TYPE_U32 && h->types[1] == TYPE_U32 && h->types[2] == TYPE_U32;
+}
+
+// The span arguments hold the lower 32 bits of the microseconds, the upper ones come from the record timestamp
+static uint64_t span_micros(uint32_t timestamp, const LoggingValueU *values) {
+    uint64_t base = (uint64_t)timestamp * 1000;
+    return base + (int32_t)(values[2].val_uint - (uint32_t)base);
+}
+
+// Format strings are validated and parsed once here, broken ones are reported before any message is converted
+void header_list_compile_formats(HeaderList *list) {
+    list->programs = calloc(list->size, sizeof(list->programs[0]));
+
+    for (size_t i = 0; i < list->size; ++i) {
+        if (is_span_header(list->headers[i])) continue;
+
+        char error[128];
+        if (!format_program_compile(&list->programs[i], list->headers[i], error, sizeof error)) {
+            LogHeader *h = list->headers[i];
+            printf("WARN: invalid format string \"%s\" for message with id %lld (%s:%d): %s\n",
+                   h->fmt_str.data, (long long)list->ids[i], h->filename.data, h->line, error);
+        }
+    }
+}
+
+// The static strings of a header are escaped once here instead of once per message
+void header_list_escape(HeaderList *list, EscapeMode mode) {
+    header_list_free_escaped(list);
+    list->escaped = malloc(list->size * sizeof(list->escaped[0]));
+
+    for (size_t i = 0; i < list->size; ++i) {
+        LogHeader *h = list->headers[i];
+        list->escaped[i] = (EscapedHeader) {
+            .fmt_str = escape_string_view(mode, h->fmt_str),
+            .filename = escape_string_view(mode, h->filename),
+            .function = escape_string_view(mode, h->function),
+        };
+    }
+}
+
+static void write_string_view(FILE *f, StringView sv) {
+    fwrite(sv.data, 1, sv.byte_count, f);
+}
+
+static void write_escaped_cstring(FILE *f, EscapeMode mode, const char *s) {
+    escape_write(f, mode, s, strlen(s));
+}
+
+// Elements of an array value with separator between them, blobs as hex digits without a separator
+static void write_array(FILE *f, DataType type, LoggingArray array, const char *separator) {
+    for (size_t i = 0; i < array.count; ++i) {
+        LoggingValueU value = logging_array_element(type, array, i);
+        if (type == TYPE_BLOB) {
+            fprintf(f, "%02x", value.val_uint8);
+            continue;
+        }
+
+        if (i > 0) fputs(separator, f);
+        switch (data_type_element(type)) {
+            case TYPE_U8:  fprintf(f, "%u", value.val_uint8); break;
+            case TYPE_U32: fprintf(f, "%u", value.val_uint); break;
+            case TYPE_I32: fprintf(f, "%d", value.val_int); break;
+            case TYPE_F32: fprintf(f, "%f", value.val_float); break;
+            default:
+                unreachable();
+        }
+    }
+}
+
+// The formatted message without location, spans get a fixed description instead of their name
+static void write_message(FILE *f, const HeaderList *list, size_t h_index, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
+    if (is_span_header(header)) {
+        fprintf(f, "%s %s (span %u, thread %u)", header->category == CSL_CATEGORY_SPAN_BEGIN ? "begin" : "end",
+                header->fmt_str.data, values[0].val_uint, values[1].val_uint);
+    } else {
+        format_program_run(f, &list->programs[h_index], header, values);
+    }
+}
+
+// JSON array of the elements, blobs as a string of hex digits
+static void write_json_array(FILE *f, DataType type, LoggingArray array) {
+    fputc(type == TYPE_BLOB ? '"' : '[', f);
+    write_array(f, type, array, ", ");
+    fputc(type == TYPE_BLOB ? '"' : ']', f);
+}
+
+// State of the html format, the rows of the current page and the index are written while the log is read
+typedef struct {
+    char *data_dir;
+    FILE *index;
+    FILE *page;
+    size_t page_count;
+    uint32_t page_rows;
+    uint32_t first_timestamp;
+    uint32_t last_timestamp;
+    uint32_t level_counts[LL_COUNT];
+    // Reused buffer of the formatted message, it is escaped as a whole
+    FILE *message;
+    char *message_data;
+    size_t message_size;
+} HtmlPages;
+
 typedef struct {
     union {
         FILE *f;
@@ -112,6 +290,14 @@ typedef struct {
     };
     const char * filename;
     size_t msg_count;
+    // Only used by the stats formats, the report is written at the end
+    StatsCollector *stats;
+    uint32_t stats_interval_ms;
+    // Only used by the html format
+    HtmlPages html;
+    uint32_t html_page_size;
+    // Repeat records are converted to the repeated message once per repetition instead of one repeat message
+    bool expand_repeats;
 } FileFormatter;
 
 void init_formatter_file(FileFormatter *fmt, const char *default_filename, const char *modes) {
@@ -134,22 +320,31 @@ void deinit_formatter_json(FileFormatter *fmt) {
     deinit_formatter_file(fmt);
 }
 
-void handle_message_json(FileFormatter *fmt, LogHeader *header, int32_t id, uint32_t timestamp, LoggingValueU *values) {
+void handle_message_json(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
+    const EscapedHeader *escaped = &list->escaped[h_index];
+
     if (fmt->msg_count != 0 ){
         fputs(",\n", fmt->f);
     }
 
     fprintf(fmt->f, "    {\n");
-    fprintf(fmt->f, "      \"fmt_str\": \"%s\",\n", header->fmt_str.data); //TODO: escape
-    fprintf(fmt->f, "      \"id\": %d,\n", id);
+    fprintf(fmt->f, "      \"fmt_str\": \"");
+    write_string_view(fmt->f, escaped->fmt_str);
+    fprintf(fmt->f, "\",\n");
+    fprintf(fmt->f, "      \"id\": %lld,\n", (long long)list->ids[h_index]);
     fprintf(fmt->f, "      \"timestamp\": %u,\n", timestamp);
     fprintf(fmt->f, "      \"level\": {\n");
     fprintf(fmt->f, "        \"name\": \"%s\",\n", LOG_LEVEL_NAMES[header->level].data);
     fprintf(fmt->f, "        \"numeric\": %d\n", header->level);
     fprintf(fmt->f, "      },\n");
     fprintf(fmt->f, "      \"location\": {\n");
-    fprintf(fmt->f, "        \"filename\": \"%s\",\n", header->filename.data); //TODO: escape
-    fprintf(fmt->f, "        \"function\": \"%s\",\n", header->function.data); //TODO: escape
+    fprintf(fmt->f, "        \"filename\": \"");
+    write_string_view(fmt->f, escaped->filename);
+    fprintf(fmt->f, "\",\n");
+    fprintf(fmt->f, "        \"function\": \"");
+    write_string_view(fmt->f, escaped->function);
+    fprintf(fmt->f, "\",\n");
     fprintf(fmt->f, "        \"line\": %d\n", header->line);
     fprintf(fmt->f, "      },\n");
     fprintf(fmt->f, "      \"args\": [\n");
@@ -169,8 +364,17 @@ void handle_message_json(FileFormatter *fmt, LogHeader *header, int32_t id, uint
                 fprintf(fmt->f, "        %f", values[i].val_float);
                 break;
             case TYPE_CSTRING:
-                // TODO: correctly encode string here
-                fprintf(fmt->f, "        \"%s\"", values[i].val_cstring);
+                fputs("        \"", fmt->f);
+                write_escaped_cstring(fmt->f, ESCAPE_JSON, values[i].val_cstring);
+                fputc('"', fmt->f);
+                break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+            case TYPE_BLOB:
+                fputs("        ", fmt->f);
+                write_json_array(fmt->f, header->types[i], values[i].val_array);
                 break;
             case TYPE_COUNT:
                 unreachable();
@@ -192,16 +396,25 @@ void deinit_formatter_xml(FileFormatter *fmt) {
     deinit_formatter_file(fmt);
 }
 
-void handle_message_xml(FileFormatter *fmt, LogHeader *header, int32_t id, uint32_t timestamp, LoggingValueU *values) {
+void handle_message_xml(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
+    const EscapedHeader *escaped = &list->escaped[h_index];
+
     fprintf(fmt->f, "  <message>\n");
 
-    fprintf(fmt->f, "    <fmt_str>%s</fmt_str>\n", header->fmt_str.data); //TODO: escape
-    fprintf(fmt->f, "    <id>%d</id>\n", id);
+    fprintf(fmt->f, "    <fmt_str>");
+    write_string_view(fmt->f, escaped->fmt_str);
+    fprintf(fmt->f, "</fmt_str>\n");
+    fprintf(fmt->f, "    <id>%lld</id>\n", (long long)list->ids[h_index]);
     fprintf(fmt->f, "    <level numeric=\"%d\">%s</level>\n", header->level, LOG_LEVEL_NAMES[header->level].data);
     fprintf(fmt->f, "    <timestamp>%u</timestamp>\n", timestamp);
     fprintf(fmt->f, "    <location>\n");
-    fprintf(fmt->f, "       <filename>%s</filename>\n", header->filename.data);  //TODO: escape
-    fprintf(fmt->f, "       <function>%s</function>\n", header->function.data); //TODO: escape
+    fprintf(fmt->f, "       <filename>");
+    write_string_view(fmt->f, escaped->filename);
+    fprintf(fmt->f, "</filename>\n");
+    fprintf(fmt->f, "       <function>");
+    write_string_view(fmt->f, escaped->function);
+    fprintf(fmt->f, "</function>\n");
     fprintf(fmt->f, "       <line>%d</line>\n", header->line);
     fprintf(fmt->f, "    </location>\n");
     fprintf(fmt->f, "    <args>\n");
@@ -221,8 +434,23 @@ void handle_message_xml(FileFormatter *fmt, LogHeader *header, int32_t id, uint3
                 fprintf(fmt->f, "       <f32>%f</f32>\n", values[i].val_float);
                 break;
             case TYPE_CSTRING:
-                // TODO: correctly encode string here
-                fprintf(fmt->f, "       <string>%s</string>\n", values[i].val_cstring);
+                fputs("       <string>", fmt->f);
+                write_escaped_cstring(fmt->f, ESCAPE_XML, values[i].val_cstring);
+                fputs("</string>\n", fmt->f);
+                break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+                fprintf(fmt->f, "       <array type=\"%s\" count=\"%u\">",
+                        DATA_TYPE_NAMES[data_type_element(header->types[i])].data, values[i].val_array.count);
+                write_array(fmt->f, header->types[i], values[i].val_array, " ");
+                fputs("</array>\n", fmt->f);
+                break;
+            case TYPE_BLOB:
+                fprintf(fmt->f, "       <blob count=\"%u\">", values[i].val_array.count);
+                write_array(fmt->f, header->types[i], values[i].val_array, "");
+                fputs("</blob>\n", fmt->f);
                 break;
             case TYPE_COUNT:
                 unreachable();
@@ -232,54 +460,117 @@ void handle_message_xml(FileFormatter *fmt, LogHeader *header, int32_t id, uint3
     fprintf(fmt->f, "  </message>\n");
 }
 
+// The html format writes a small viewer page and the messages as pages of JSONP scripts into <outfile>.data/.
+// The viewer loads index.js first and only the pages that are scrolled into view, so it stays fast for any log size.
+// Scripts instead of JSON files keep the viewer working when it is opened from file://.
 void init_formatter_html(FileFormatter *fmt) {
     init_formatter_file(fmt, "log.html", "w");
-    fwrite(HTML_TABLE_START.data, 1, HTML_TABLE_START.byte_count, fmt->f);
+    if (fmt->html_page_size == 0) fmt->html_page_size = 1000;
+
+    size_t name_length = strlen(fmt->filename);
+    fmt->html.data_dir = malloc(name_length + sizeof ".data");
+    memcpy(fmt->html.data_dir, fmt->filename, name_length);
+    memcpy(fmt->html.data_dir + name_length, ".data", sizeof ".data");
+    if (mkdir(fmt->html.data_dir, 0755) != 0 && errno != EEXIST) {
+        printf("Can't create the directory %s\n", fmt->html.data_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    // The page finds its data next to itself, relative to the directory of the page
+    const char *base_name = strrchr(fmt->html.data_dir, '/');
+    base_name = base_name != nullptr ? base_name + 1 : fmt->html.data_dir;
+    write_string_view(fmt->f, HTML_VIEWER_HEAD);
+    fputs("<script>const CSL_DATA_DIR = \"", fmt->f);
+    write_escaped_cstring(fmt->f, ESCAPE_JSON, base_name);
+    fputs("/\";</script>\n", fmt->f);
+    for (size_t i = 0; i < HTML_VIEWER_BODY_COUNT; ++i) write_string_view(fmt->f, HTML_VIEWER_BODY[i]);
+
+    char path[4096];
+    snprintf(path, sizeof path, "%s/index.js", fmt->html.data_dir);
+    fmt->html.index = fopen(path, "w");
+    if (fmt->html.index == nullptr) {
+        printf("Can't open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fmt->html.index, "csl_index_start(%u, [", fmt->html_page_size);
+    for (int i = 0; i < LL_COUNT; ++i) fprintf(fmt->html.index, "%s\"%s\"", i == 0 ? "" : ", ", LOG_LEVEL_NAMES[i].data);
+    fputs("]);\n", fmt->html.index);
+
+    fmt->html.message = open_memstream(&fmt->html.message_data, &fmt->html.message_size);
+}
+
+// Closes the current page and adds its timestamp range and level counts to the index
+static void html_finish_page(FileFormatter *fmt) {
+    HtmlPages *html = &fmt->html;
+    if (html->page == nullptr) return;
+
+    fputs("\n]);\n", html->page);
+    fclose(html->page);
+    html->page = nullptr;
+
+    fprintf(html->index, "csl_index_page(%zu, %u, %u, %u, [", html->page_count, html->first_timestamp,
+            html->last_timestamp, html->page_rows);
+    for (int i = 0; i < LL_COUNT; ++i) fprintf(html->index, "%s%u", i == 0 ? "" : ", ", html->level_counts[i]);
+    fputs("]);\n", html->index);
+
+    html->page_count += 1;
+    html->page_rows = 0;
 }
 
 void deinit_formatter_html(FileFormatter *fmt) {
-    fwrite(HTML_TABLE_END.data, 1, HTML_TABLE_END.byte_count, fmt->f);
+    html_finish_page(fmt);
+    fprintf(fmt->html.index, "csl_index_done();\n");
+    fclose(fmt->html.index);
+    fclose(fmt->html.message);
+    free(fmt->html.message_data);
+    free(fmt->html.data_dir);
+    fmt->html = (HtmlPages) {};
     deinit_formatter_file(fmt);
 }
 
-void handle_message_html(FileFormatter *fmt, LogHeader *header, int32_t id, uint32_t timestamp, LoggingValueU *values) {
-    fputs("    <tr>\n", fmt->f);
-    fprintf(fmt->f, "        <td>%zu</td>\n", fmt->msg_count);
-    fprintf(fmt->f, "        <td>%s</td>\n", LOG_LEVEL_NAMES[header->level].data);
-    fprintf(fmt->f, "        <td>%u</td>\n", timestamp);
-    fprintf(fmt->f, "        <td>%s</td>\n", header->filename.data);
-    fprintf(fmt->f, "        <td>%s</td>\n", header->function.data);
-    fprintf(fmt->f, "        <td>%d</td>\n", header->line);
-    fprintf(fmt->f, "        <td>%d</td>\n", id);
-    fprintf(fmt->f, "        <td>%s</td>\n", header->fmt_str.data);
-
-    for (size_t i = 0; i < CSL_MAX_ARG_COUNT; ++i) {
-        if (i >= header->arg_count) {
-            fputs("        <td></td>\n", fmt->f);
-            continue;
-        }
+void flush_formatter_html(FileFormatter *fmt) {
+    fflush(fmt->f);
+    fflush(fmt->html.index);
+    if (fmt->html.page != nullptr) fflush(fmt->html.page);
+}
 
-        switch (header->types[i]) {
-            case TYPE_U8:
-                fprintf(fmt->f, "        <td>%u</td>", values[i].val_uint8);
-                break;
-            case TYPE_U32:
-                fprintf(fmt->f, "        <td>%u</td>", values[i].val_uint);
-                break;
-            case TYPE_I32:
-                fprintf(fmt->f, "        <td>%d</td>", values[i].val_int);
-                break;
-            case TYPE_F32:
-                fprintf(fmt->f, "        <td>%f</td>", values[i].val_float);
-                break;
-            case TYPE_CSTRING:
-                fprintf(fmt->f, "        <td>%s</td>", values[i].val_cstring); // TODO: encode
-                break;
-            case TYPE_COUNT:
-                unreachable();
+// One row per message: [timestamp, level, "file:line", "message"], only the current page is kept open
+void handle_message_html(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
+    const EscapedHeader *escaped = &list->escaped[h_index];
+    HtmlPages *html = &fmt->html;
+
+    if (html->page == nullptr) {
+        char path[4096];
+        snprintf(path, sizeof path, "%s/page_%06zu.js", html->data_dir, html->page_count);
+        html->page = fopen(path, "w");
+        if (html->page == nullptr) {
+            printf("Can't open %s\n", path);
+            exit(EXIT_FAILURE);
         }
+        fprintf(html->page, "csl_page(%zu, [\n", html->page_count);
+        html->first_timestamp = timestamp;
+        memset(html->level_counts, 0, sizeof html->level_counts);
+    } else {
+        fputs(",\n", html->page);
     }
-    fputs("    </tr>\n", fmt->f);
+
+    html->last_timestamp = timestamp;
+    html->level_counts[header->level] += 1;
+
+    rewind(html->message);
+    write_message(html->message, list, h_index, values);
+    fflush(html->message);
+    size_t message_length = ftell(html->message);
+
+    fprintf(html->page, "[%u,%d,\"", timestamp, header->level);
+    write_string_view(html->page, escaped->filename);
+    fprintf(html->page, ":%d\",\"", header->line);
+    escape_write(html->page, ESCAPE_JSON, html->message_data, message_length);
+    fputs("\"]", html->page);
+
+    html->page_rows += 1;
+    if (html->page_rows == fmt->html_page_size) html_finish_page(fmt);
 }
 
 #ifdef SQLITE_AVAILABLE
@@ -317,7 +608,10 @@ void deinit_formatter_sqlite(FileFormatter *fmt) {
     sqlite3_close(fmt->db);
 }
 
-void handle_message_sqlite(FileFormatter *fmt, LogHeader *header, int32_t id, uint32_t timestamp, LoggingValueU *values) {
+void handle_message_sqlite(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
+    int64_t id = list->ids[h_index];
+
     if (header->category != '~') {
         const char *INSERT_META_MSG = "INSERT INTO LogMeta VALUES(?, ?, ?, ?, ?, ?)";
         sqlite3_stmt *stmt;
@@ -325,14 +619,15 @@ void handle_message_sqlite(FileFormatter *fmt, LogHeader *header, int32_t id, ui
         sqlite_error_check(rc, fmt->db);
 
         // TODO: check return codes of those
-        sqlite3_bind_int(stmt, 1, id);
+        sqlite3_bind_int64(stmt, 1, id);
         sqlite3_bind_int(stmt, 2, (int)header->level);
         sqlite3_bind_int(stmt, 3, (int)header->line);
         sqlite3_bind_text(stmt, 4,header->filename.data, (int)header->filename.byte_count, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 5,header->function.data, (int)header->function.byte_count, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 6,header->fmt_str.data, (int)header->fmt_str.byte_count, SQLITE_STATIC);
 
-        sqlite3_step(stmt); // TODO: error check
+        rc = sqlite3_step(stmt);
+        sqlite_error_check(rc == SQLITE_DONE ? SQLITE_OK : rc, fmt->db);
         sqlite3_finalize(stmt);
 
         header->category = '~';
@@ -347,7 +642,7 @@ void handle_message_sqlite(FileFormatter *fmt, LogHeader *header, int32_t id, ui
 
     // TODO: check return codes of those
     sqlite3_bind_int64(stmt, 1, (long long)fmt->msg_count);
-    sqlite3_bind_int(stmt, 2, id);
+    sqlite3_bind_int64(stmt, 2, id);
     sqlite3_bind_int64(stmt, 3, timestamp);
 
     for (int i = 0; i < CSL_MAX_ARG_COUNT; ++i) {
@@ -372,12 +667,23 @@ void handle_message_sqlite(FileFormatter *fmt, LogHeader *header, int32_t id, ui
             case TYPE_CSTRING:
                 sqlite3_bind_text(stmt, i + 4, values[i].val_cstring, -1, SQLITE_TRANSIENT);
                 break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+            case TYPE_BLOB:
+                // The elements as they were logged, in the byte order of the producer
+                sqlite3_bind_blob(stmt, i + 4, values[i].val_array.data,
+                                  (int)(values[i].val_array.count * DATA_TYPE_ELEMENT_SIZES[header->types[i]]),
+                                  SQLITE_TRANSIENT);
+                break;
             case TYPE_COUNT:
                 unreachable();
         }
     }
 
-    sqlite3_step(stmt); // TODO: error check
+    rc = sqlite3_step(stmt);
+    sqlite_error_check(rc == SQLITE_DONE ? SQLITE_OK : rc, fmt->db);
     sqlite3_finalize(stmt);
 }
 #endif
@@ -390,45 +696,88 @@ void deinit_formatter_string(FileFormatter *fmt) {
     deinit_formatter_file(fmt);
 }
 
-void handle_message_string(FileFormatter *fmt, LogHeader *header, int32_t id, uint32_t timestamp, LoggingValueU *values) {
-    size_t current_arg = 0;
-    size_t last_start = 0;
+void handle_message_string(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
     fprintf(fmt->f, "[%c] [%u] %s:%d | ", LOG_LEVEL_NAMES_SHORT[header->level], timestamp, header->filename.data, header->line);
+    write_message(fmt->f, list, h_index, values);
+    fputc('\n', fmt->f);
+}
 
-    for (int i = 0; i < header->fmt_str.byte_count; ++i) {
-        if (header->fmt_str.data[i] != '{') continue;
-        assert(header->fmt_str.data[i+1] == '}');
+// Trace Event Format for chrome://tracing and Perfetto, spans become B/E events and other messages instant events
+void init_formatter_chrome_trace(FileFormatter *fmt) {
+    init_formatter_file(fmt, "trace.json", "w");
+    fprintf(fmt->f, "{\n");
+    fprintf(fmt->f, "  \"displayTimeUnit\": \"ms\",\n");
+    fprintf(fmt->f, "  \"traceEvents\": [\n");
+}
 
-        fwrite(header->fmt_str.data + last_start, 1, i - last_start, fmt->f);
-        last_start = i + 2;
+void deinit_formatter_chrome_trace(FileFormatter *fmt) {
+    fprintf(fmt->f, "\n  ]\n}\n");
+    deinit_formatter_file(fmt);
+}
 
-        switch (header->types[current_arg]) {
-            case TYPE_U8:
-                fprintf(fmt->f, "%u", values[current_arg].val_uint8);
-                break;
-            case TYPE_U32:
-                fprintf(fmt->f, "%u", values[current_arg].val_uint);
-                break;
-            case TYPE_I32:
-                fprintf(fmt->f, "%d", values[current_arg].val_int);
-                break;
-            case TYPE_F32:
-                fprintf(fmt->f, "%f", values[current_arg].val_float);
-                break;
+void handle_message_chrome_trace(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    LogHeader *header = list->headers[h_index];
+    const EscapedHeader *escaped = &list->escaped[h_index];
+
+    if (fmt->msg_count != 0) fputs(",\n", fmt->f);
+
+    fputs("    {\"name\": \"", fmt->f);
+    write_string_view(fmt->f, escaped->fmt_str);
+    fprintf(fmt->f, "\", \"cat\": \"%s\", \"pid\": 1, ", LOG_LEVEL_NAMES[header->level].data);
+
+    if (is_span_header(header)) {
+        fprintf(fmt->f, "\"ph\": \"%c\", \"tid\": %u, \"ts\": %lu, \"args\": {\"span\": %u}}",
+                header->category, values[1].val_uint, (unsigned long)span_micros(timestamp, values), values[0].val_uint);
+        return;
+    }
+
+    fprintf(fmt->f, "\"ph\": \"i\", \"s\": \"p\", \"tid\": 0, \"ts\": %lu, \"args\": {\"location\": \"",
+            (unsigned long)timestamp * 1000);
+    write_string_view(fmt->f, escaped->filename);
+    fprintf(fmt->f, ":%d\"", header->line);
+
+    for (size_t i = 0; i < header->arg_count; ++i) {
+        fprintf(fmt->f, ", \"%zu\": ", i);
+        switch (header->types[i]) {
+            case TYPE_U8:  fprintf(fmt->f, "%u", values[i].val_uint8); break;
+            case TYPE_U32: fprintf(fmt->f, "%u", values[i].val_uint); break;
+            case TYPE_I32: fprintf(fmt->f, "%d", values[i].val_int); break;
+            case TYPE_F32: fprintf(fmt->f, "%f", values[i].val_float); break;
             case TYPE_CSTRING:
-                fprintf(fmt->f, "%s", values[current_arg].val_cstring);
+                fputc('"', fmt->f);
+                write_escaped_cstring(fmt->f, ESCAPE_JSON, values[i].val_cstring);
+                fputc('"', fmt->f);
+                break;
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+            case TYPE_BLOB:
+                write_json_array(fmt->f, header->types[i], values[i].val_array);
                 break;
             case TYPE_COUNT:
                 unreachable();
         }
-        current_arg += 1;
     }
+    fputs("}}", fmt->f);
+}
 
-    if (current_arg != header->arg_count) {
-        printf("Invalid format string for message with id %d\n", id);
-    }
+void init_formatter_stats(FileFormatter *fmt, const char *default_filename) {
+    init_formatter_file(fmt, default_filename, "w");
+    fmt->stats = stats_create(fmt->stats_interval_ms);
+}
 
-    fputc('\n', fmt->f);
+void deinit_formatter_stats(FileFormatter *fmt, bool json) {
+    if (json)   stats_write_json(fmt->f, fmt->stats);
+    else        stats_write_report(fmt->f, fmt->stats);
+    stats_free(fmt->stats);
+    deinit_formatter_file(fmt);
+}
+
+// Values go straight into the accumulators, nothing is rendered per message
+void handle_message_stats(FileFormatter *fmt, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    stats_add(fmt->stats, list->headers[h_index], list->ids[h_index], timestamp, values);
 }
 
 enum OutputFormat {
@@ -436,6 +785,9 @@ enum OutputFormat {
     OUTPUT_FMT_JSON,
     OUTPUT_FMT_XML,
     OUTPUT_FMT_HTML,
+    OUTPUT_FMT_STATS,
+    OUTPUT_FMT_STATS_JSON,
+    OUTPUT_FMT_CHROME_TRACE,
 #ifdef SQLITE_AVAILABLE
     OUTPUT_FMT_SQLITE,
 #endif
@@ -447,6 +799,9 @@ const char *OUTPUT_FMT_NAMES[] = {
         "json",
         "xml",
         "html",
+        "stats",
+        "stats-json",
+        "chrome-trace",
 #ifdef SQLITE_AVAILABLE
         "sqlite",
 #endif
@@ -467,6 +822,15 @@ void init_formatter(FileFormatter *formatter, enum OutputFormat format) {
         case OUTPUT_FMT_HTML:
             init_formatter_html(formatter);
             break;
+        case OUTPUT_FMT_STATS:
+            init_formatter_stats(formatter, "stats.txt");
+            break;
+        case OUTPUT_FMT_STATS_JSON:
+            init_formatter_stats(formatter, "stats.json");
+            break;
+        case OUTPUT_FMT_CHROME_TRACE:
+            init_formatter_chrome_trace(formatter);
+            break;
 #ifdef SQLITE_AVAILABLE
         case OUTPUT_FMT_SQLITE:
             init_formatter_sqlite(formatter);
@@ -491,6 +855,15 @@ void deinit_formatter(FileFormatter *formatter, enum OutputFormat format) {
         case OUTPUT_FMT_HTML:
             deinit_formatter_html(formatter);
             break;
+        case OUTPUT_FMT_STATS:
+            deinit_formatter_stats(formatter, false);
+            break;
+        case OUTPUT_FMT_STATS_JSON:
+            deinit_formatter_stats(formatter, true);
+            break;
+        case OUTPUT_FMT_CHROME_TRACE:
+            deinit_formatter_chrome_trace(formatter);
+            break;
 #ifdef SQLITE_AVAILABLE
         case OUTPUT_FMT_SQLITE:
             deinit_formatter_sqlite(formatter);
@@ -501,14 +874,58 @@ void deinit_formatter(FileFormatter *formatter, enum OutputFormat format) {
     }
 }
 
-void handle_message(FileFormatter *fmt, enum OutputFormat format, LogHeader *header, int32_t id, uint32_t timestamp, LoggingValueU *values) {
+void flush_formatter(FileFormatter *formatter, enum OutputFormat format) {
+    switch (format) {
+        case OUTPUT_FMT_STRING:
+        case OUTPUT_FMT_JSON:
+        case OUTPUT_FMT_XML:
+        case OUTPUT_FMT_CHROME_TRACE:
+            fflush(formatter->f);
+            break;
+        case OUTPUT_FMT_HTML:
+            flush_formatter_html(formatter);
+            break;
+        case OUTPUT_FMT_STATS:
+        case OUTPUT_FMT_STATS_JSON:
+            break;
+#ifdef SQLITE_AVAILABLE
+        case OUTPUT_FMT_SQLITE:
+            break;
+#endif
+        case OUTPUT_FMT_COUNT:
+            unreachable();
+    }
+}
+
+void prepare_header_list(HeaderList *list, enum OutputFormat format) {
     switch (format) {
-        case OUTPUT_FMT_STRING: handle_message_string(fmt, header, id, timestamp, values); break;
-        case OUTPUT_FMT_JSON:   handle_message_json(fmt, header, id, timestamp, values); break;
-        case OUTPUT_FMT_XML:    handle_message_xml(fmt, header, id, timestamp, values); break;
-        case OUTPUT_FMT_HTML:   handle_message_html(fmt, header, id, timestamp, values); break;
+        case OUTPUT_FMT_JSON:   header_list_escape(list, ESCAPE_JSON); break;
+        case OUTPUT_FMT_XML:    header_list_escape(list, ESCAPE_XML); break;
+        case OUTPUT_FMT_HTML:   header_list_escape(list, ESCAPE_JSON); break;
+        case OUTPUT_FMT_CHROME_TRACE: header_list_escape(list, ESCAPE_JSON); break;
+        case OUTPUT_FMT_STRING: break;
+        case OUTPUT_FMT_STATS: break;
+        case OUTPUT_FMT_STATS_JSON: break;
 #ifdef SQLITE_AVAILABLE
-        case OUTPUT_FMT_SQLITE: handle_message_sqlite(fmt, header, id, timestamp, values); break;
+        case OUTPUT_FMT_SQLITE: break;
+#endif
+        case OUTPUT_FMT_COUNT:
+            unreachable();
+    }
+}
+
+void handle_message(FileFormatter *fmt, enum OutputFormat format, const HeaderList *list, size_t h_index, uint32_t timestamp, LoggingValueU *values) {
+    switch (format) {
+        case OUTPUT_FMT_STRING: handle_message_string(fmt, list, h_index, timestamp, values); break;
+        case OUTPUT_FMT_JSON:   handle_message_json(fmt, list, h_index, timestamp, values); break;
+        case OUTPUT_FMT_XML:    handle_message_xml(fmt, list, h_index, timestamp, values); break;
+        case OUTPUT_FMT_HTML:   handle_message_html(fmt, list, h_index, timestamp, values); break;
+        case OUTPUT_FMT_STATS:
+        case OUTPUT_FMT_STATS_JSON:
+                                handle_message_stats(fmt, list, h_index, timestamp, values); break;
+        case OUTPUT_FMT_CHROME_TRACE: handle_message_chrome_trace(fmt, list, h_index, timestamp, values); break;
+#ifdef SQLITE_AVAILABLE
+        case OUTPUT_FMT_SQLITE: handle_message_sqlite(fmt, list, h_index, timestamp, values); break;
 #endif
         case OUTPUT_FMT_COUNT:
             unreachable();
@@ -516,7 +933,18 @@ void handle_message(FileFormatter *fmt, enum OutputFormat format, LogHeader *hea
 }
 
 void print_help(int argc, char **argv) {
-    printf("Usage: %s [--format fmt] [--outfile file] --program executable --log log_file\n", argv[0]);
+    printf("Usage: %s [--format fmt] [--outfile file] --program executable [--program ...] --log log_file [--log ...]\n", argv[0]);
+    printf("       %s [--format fmt] [--outfile file] --program executable [--program ...] --attach shm_name\n", argv[0]);
+    puts("  --attach reads the records of a CSL_SINK_SHM logger while they are produced, stop with Ctrl+C");
+    puts("  Several --log files are merged by timestamp");
+    puts("  Every --program (executable, shared library or plugin) is used for all logs, give one per image with callsites");
+    puts("  --stats writes per callsite counts, argument statistics and message rates instead of the messages,\n"
+         "          short for --format stats, or --format stats-json with --format json");
+    puts("  --page-size rows sets the rows per data page of the html viewer, default 1000");
+    puts("  --interval ms sets the interval of the message rates of the stats formats, default 1000");
+    puts("  --pid pid only converts the records of one process of a CSL_SINK_SHARED_FILE log or csl_collectd segment");
+    puts("  --expand-repeats writes every repetition of a coalesced message instead of one repeat message");
+    puts("  --timings prints the time, MB/s and records/s of the ELF load, header discovery, decoding and formatting");
     puts("Available formats:");
     for (int i = 0; i < OUTPUT_FMT_COUNT; ++i) {
         printf("  %s%s\n", OUTPUT_FMT_NAMES[i], (i == 0)?" (default)" : "");
@@ -553,7 +981,8 @@ char* read_file_content(const char *target_program_name) {
     return file_content;
 }
 
-void parse_elf_section(char *file_content, MemoryView *data_section, MemoryView *build_id) {
+// data_address is the virtual address of .data, the callsite index of a header is computed from it
+void parse_elf_section(char *file_content, MemoryView *data_section, uint64_t *data_address, MemoryView *build_id) {
     Elf64_Ehdr *elf_header = (Elf64_Ehdr *)file_content;
     Elf64_Shdr *section_header = (Elf64_Shdr *)(file_content + elf_header->e_shoff);
 
@@ -566,6 +995,7 @@ void parse_elf_section(char *file_content, MemoryView *data_section, MemoryView
         if (strcmp(section_name, ".data") == 0) {
             data_section->byte_count = section_header[i].sh_size;
             data_section->data = file_content + section_header[i].sh_offset;
+            *data_address = section_header[i].sh_addr;
             continue;
         }
 
@@ -590,7 +1020,9 @@ void parse_elf_section(char *file_content, MemoryView *data_section, MemoryView
 
 }
 
-void build_header_list(HeaderList *list, MemoryView data_section, char *file_content) {
+// print_headers dumps every discovered header, it is turned off for benchmarks
+void build_header_list(HeaderList *list, MemoryView data_section, uint64_t data_address, int32_t module_key,
+                       char *file_content, bool print_headers) {
     char HEADER_MARKER[] = LOGGING_HEADER_MAGIC_NUMBER;
 
     header_list_init(list);
@@ -598,24 +1030,28 @@ void build_header_list(HeaderList *list, MemoryView data_section, char *file_con
     for (size_t i = 0; i < data_section.byte_count - sizeof(LogHeader) + 1; ++i) {
         if (data_section.data[i] != HEADER_MARKER[0]) continue;
         if (0 != memcmp(data_section.data + i, HEADER_MARKER, sizeof HEADER_MARKER)) continue;
+        // The marker also appears in the middle of other data, a LogHeader is always aligned
+        if ((data_address + i) % alignof(LogHeader) != 0) continue;
 
         LogHeader *header = (LogHeader *)(data_section.data + i);
-        printf("Found logging header at %lu, (%c)\n", i, header->category);
+        if (print_headers) printf("Found logging header at %lu, (%c)\n", i, header->category);
 
-        header_list_append(list, header);
+        header_list_append(list, header,
+                           csl_callsite_id_make(module_key, (uint32_t)((data_address + i) / alignof(LogHeader))));
     }
-    header_list_fill_ids(list);
     header_list_fix_string(list, file_content);
+    header_list_append_repeats(list);
+    header_list_index(list);
+    header_list_compile_formats(list);
+    if (!print_headers) return;
     puts("===============================================================================");
 
-    for (size_t i = 0; i < list->size; ++i) {
-        if (i == list->sentinel_index) continue;
-
+    for (size_t i = 0; i < list->repeat_index; ++i) {
         puts("------------------------------------------------------------");
 
         LogHeader *h = list->headers[i];
 
-        printf("Logging header with id %d\n", list->ids[i]);
+        printf("Logging header with id %lld\n", (long long)list->ids[i]);
 
         printf("--> fmt_str: %s\n", h->fmt_str.data);
         printf("--> arg_count: %lu\n", h->arg_count);
@@ -635,22 +1071,747 @@ void build_header_list(HeaderList *list, MemoryView data_section, char *file_con
     puts("===============================================================================");
 }
 
+typedef struct {
+    const char *name;
+    char *file_content;
+    MemoryView build_id;
+    int32_t module_key;
+    HeaderList list;
+} ProgramImage;
+
+// The program and the shared libraries given with --program, records find the image of their callsite by the
+// module key of the callsite id
+typedef struct {
+    size_t count;
+    ProgramImage *programs;
+    // Program index + 1 by module key, open addressing with a power of two slot count, 0 marks a free slot
+    size_t slot_count;
+    uint32_t *slots;
+} ProgramSet;
+
+static size_t program_set_slot(const ProgramSet *set, int32_t module_key) {
+    uint32_t h = (uint32_t)module_key * 0x9e3779b1u;
+    h ^= h >> 16;
+
+    size_t slot = h & (set->slot_count - 1);
+    while (set->slots[slot] != 0 && set->programs[set->slots[slot] - 1].module_key != module_key) {
+        slot = (slot + 1) & (set->slot_count - 1);
+    }
+    return slot;
+}
+
+// Images with the same module key can't be told apart in a log, the first one of them is used
+void program_set_index(ProgramSet *set) {
+    set->slot_count = 16;
+    while (set->slot_count < 2 * set->count) set->slot_count *= 2;
+    set->slots = calloc(set->slot_count, sizeof(set->slots[0]));
+
+    for (size_t i = 0; i < set->count; ++i) {
+        size_t slot = program_set_slot(set, set->programs[i].module_key);
+        if (set->slots[slot] != 0) {
+            printf("WARN: %s has the same module key as %s, its callsites can't be converted\n",
+                   set->programs[i].name, set->programs[set->slots[slot] - 1].name);
+            continue;
+        }
+        set->slots[slot] = (uint32_t)i + 1;
+    }
+}
+
+const ProgramImage *program_set_find(const ProgramSet *set, int32_t module_key) {
+    uint32_t slot = set->slots[program_set_slot(set, module_key)];
+    return slot == 0 ? nullptr : &set->programs[slot - 1];
+}
+
+// The build id of a program without one matches every log, the ids are padded to 32 bytes in the log
+static bool build_id_matches(MemoryView build_id, const char *logged_build_id) {
+    if (build_id.byte_count == 0) return true;
+    return build_id.byte_count <= 32 && memcmp(build_id.data, logged_build_id, build_id.byte_count) == 0;
+}
+
+// True if one of the programs was built with the logged build id, or can't be checked for lack of a build id
+static bool program_set_has_build_id(const ProgramSet *set, const char *logged_build_id) {
+    const ProgramImage *program = program_set_find(set, csl_module_key(logged_build_id, 32));
+    if (program != nullptr && build_id_matches(program->build_id, logged_build_id)) return true;
+    return program_set_find(set, 0) != nullptr;
+}
+
+bool read_log_file_header(FILE *log_file, const char *log_name, const ProgramSet *programs, uint32_t *flags) {
+    uint32_t magic_num = 0;
+    read_binary_u32(&magic_num, log_file);
+    if (magic_num != LOGGING_FILE_HEADER_MAGIC_NUMBER) {
+        printf("%s is not a log file\n", log_name);
+        return false;
+    }
+
+    uint32_t version_number = 0;
+    read_binary_u32(&version_number, log_file);
+    if (version_number != LOGGING_FILE_HEADER_VERSION_NUMBER) {
+        printf("Unsupported version %u of log file %s\n", version_number, log_name);
+        return false;
+    }
+
+    char logging_build_id[32] = {};
+    (void)!fread(&logging_build_id, 1, 32, log_file); //TODO: handle error
+
+    // Segments of csl_collectd have no build id in the header, it is in the process record of every process
+    static const char NO_BUILD_ID[32] = {};
+    bool collected = memcmp(logging_build_id, NO_BUILD_ID, sizeof NO_BUILD_ID) == 0;
+
+    if (!collected && !program_set_has_build_id(programs, logging_build_id)) {
+        puts("Warning: mismatch of build ids detected!");
+        for (size_t i = 0; i < programs->count; ++i) {
+            printf("ID in target program %s", programs->programs[i].name);
+            print_n_bytes("", programs->programs[i].build_id.data, programs->programs[i].build_id.byte_count);
+        }
+
+        printf("ID log file %s was produced with", log_name);
+        print_n_bytes("", logging_build_id, programs->programs[0].build_id.byte_count);
+        puts("===============================================================================");
+//        return EXIT_FAILURE;
+    }
+
+    *flags = 0;
+    read_binary_u32(flags, log_file);
+    if ((*flags & ~CSL_FILE_FLAG_COMPACT) != 0) {
+        printf("Unsupported flags 0x%x of log file %s\n", *flags, log_name);
+        return false;
+    }
+
+    for (int i = 0; i < LOGGING_FILE_HEADER_RESERVED_COUNT; ++i) {
+        uint8_t dummy;
+        read_binary_u8(&dummy, log_file);
+    }
+    return true;
+}
+
+typedef enum {
+    RECORD_READ,
+    RECORD_END,
+    RECORD_UNKNOWN_ID,
+    RECORD_TRUNCATED,
+} RecordStatus;
+
+typedef struct {
+    // Header list of the image with the callsite
+    const HeaderList *list;
+    uint32_t h_index;
+    uint32_t timestamp;
+    LoggingValueU values[CSL_MAX_ARG_COUNT];
+    // Repetitions of the message between repeat_timestamp and timestamp, 0 for a regular record
+    uint32_t repeat_count;
+    uint32_t repeat_timestamp;
+} DecodedRecord;
+
+typedef struct {
+    const HeaderList *list;
+    uint32_t h_index;
+} CallsiteRef;
+
+// Decoding state of one stream of records
+typedef struct {
+    // Strings of the current record, reset before the next record is read
+    Arena strings;
+
+    // A repeat record refers to the last record, which is kept by the caller in the DecodedRecord
+    bool has_previous;
+    bool compact;
+    // Process records of csl_collectd segments are checked against the programs, a mismatch is reported once
+    bool build_id_reported;
+    uint32_t timestamp;
+    // Callsite per dictionary index
+    size_t size;
+    size_t capacity;
+    CallsiteRef *callsites;
+} RecordStream;
+
+void record_stream_free(RecordStream *stream) {
+    arena_free(&stream->strings);
+    free(stream->callsites);
+    *stream = (RecordStream) {};
+}
+
+// The repeated message stays in record, a repeat without a record before it (the record was overwritten in a
+// flight recorder or lost in an overrun) is skipped
+static bool read_repeat(RecordStream *stream, DecodedRecord *record, uint32_t count, uint32_t first, uint32_t last) {
+    if (!stream->has_previous) {
+        printf("Skipping %u repetitions of a message that is not in the log\n", count);
+        return false;
+    }
+    record->repeat_count = count;
+    record->repeat_timestamp = first;
+    record->timestamp = last;
+    return true;
+}
+
+// The module record follows the module key in both encodings, it only matters for images without a --program
+static bool read_module(FILE *log_file, const ProgramSet *programs) {
+    int32_t module_key = 0;
+    uint64_t base = 0;
+    char build_id[32];
+    read_binary_i32(&module_key, log_file);
+    read_binary_u64(&base, log_file);
+    if (fread(build_id, 1, sizeof build_id, log_file) != sizeof build_id) return false;
+
+    if (program_set_find(programs, module_key) == nullptr) {
+        size_t build_id_size = sizeof build_id;
+        while (build_id_size > 0 && build_id[build_id_size - 1] == 0) --build_id_size;
+        printf("Warning: the log has callsites of the image loaded at 0x%llx, which is not given with --program\n",
+               (unsigned long long)base);
+        print_n_bytes("Build ID of the image", build_id, build_id_size);
+    }
+    return true;
+}
+
+static RecordStatus resolve_callsite(const ProgramSet *programs, int32_t module_key, uint32_t callsite_index,
+                                     DecodedRecord *record) {
+    const ProgramImage *program = program_set_find(programs, module_key);
+    if (program == nullptr) {
+        printf("Unknown module key %d, stopping the conversion\n", module_key);
+        return RECORD_UNKNOWN_ID;
+    }
+    record->list = &program->list;
+    record->h_index = header_list_lookup(&program->list, callsite_index);
+    if (record->h_index == UINT32_MAX) {
+        printf("Unknown logging id %lld, stopping the conversion\n",
+               (long long)csl_callsite_id_make(module_key, callsite_index));
+        return RECORD_UNKNOWN_ID;
+    }
+    return RECORD_READ;
+}
+
+RecordStatus read_record_compact(FILE *log_file, const ProgramSet *programs, RecordStream *stream,
+                                 DecodedRecord *record) {
+    uint32_t code;
+
+    while (read_binary_varint_u32(&code, log_file)) {
+        if (code == CSL_COMPACT_CODE_PADDING) {
+            uint32_t padding = 0;
+            read_binary_u32(&padding, log_file);
+            fseek(log_file, padding, SEEK_CUR);
+            continue;
+        }
+
+        if (code == CSL_COMPACT_CODE_NEW) {
+            int32_t module_key = 0;
+            read_binary_varint_i32(&module_key, log_file);
+            if (module_key == CSL_RECORD_REPEAT) {
+                uint32_t count = 0;
+                int32_t delta = 0;
+                uint32_t span = 0;
+                read_binary_varint_u32(&count, log_file);
+                read_binary_varint_i32(&delta, log_file);
+                if (read_binary_varint_u32(&span, log_file) == 0) return RECORD_TRUNCATED;
+                uint32_t first = stream->timestamp + (uint32_t)delta;
+                stream->timestamp = first + span;
+                if (read_repeat(stream, record, count, first, stream->timestamp)) return RECORD_READ;
+                continue;
+            }
+            if (module_key == CSL_RECORD_MODULE) {
+                if (!read_module(log_file, programs)) return RECORD_TRUNCATED;
+                continue;
+            }
+
+            uint32_t callsite_index = 0;
+            if (read_binary_varint_u32(&callsite_index, log_file) == 0) return RECORD_TRUNCATED;
+            arena_reset(&stream->strings);
+            RecordStatus status = resolve_callsite(programs, module_key, callsite_index, record);
+            if (status != RECORD_READ) return status;
+
+            if (stream->size == stream->capacity) {
+                stream->capacity = stream->capacity == 0 ? 64 : 2 * stream->capacity;
+                stream->callsites = realloc(stream->callsites, stream->capacity * sizeof(stream->callsites[0]));
+            }
+            stream->callsites[stream->size++] = (CallsiteRef) {.list = record->list, .h_index = record->h_index};
+        } else {
+            size_t index = code - CSL_COMPACT_CODE_FIRST_INDEX;
+            if (index >= stream->size) {
+                printf("Unknown callsite code %u, stopping the conversion\n", code);
+                return RECORD_UNKNOWN_ID;
+            }
+            arena_reset(&stream->strings);
+            record->list = stream->callsites[index].list;
+            record->h_index = stream->callsites[index].h_index;
+        }
+
+        int32_t delta = 0;
+        if (read_binary_varint_i32(&delta, log_file) == 0) return RECORD_TRUNCATED;
+        stream->timestamp += (uint32_t)delta;
+        record->timestamp = stream->timestamp;
+
+        LogHeader *h = record->list->headers[record->h_index];
+        for (size_t i = 0; i < h->arg_count; ++i) {
+            size_t read = 0;
+            switch (h->types[i]) {
+                case TYPE_I32:
+                    read = read_binary_varint_i32(&record->values[i].val_int, log_file);
+                    break;
+                case TYPE_U32:
+                    read = read_binary_varint_u32(&record->values[i].val_uint, log_file);
+                    break;
+                case TYPE_U8:
+                case TYPE_F32:
+                case TYPE_CSTRING:
+                case TYPE_U8_ARRAY:
+                case TYPE_U32_ARRAY:
+                case TYPE_I32_ARRAY:
+                case TYPE_F32_ARRAY:
+                case TYPE_BLOB:
+                    read = read_binary_logging_value(&record->values[i], h->types[i], &stream->strings, log_file);
+                    break;
+                case TYPE_COUNT:
+                    unreachable();
+            }
+            if (read == 0) return RECORD_TRUNCATED;
+        }
+        record->repeat_count = 0;
+        stream->has_previous = true;
+        return RECORD_READ;
+    }
+    return RECORD_END;
+}
+
+// Reads the next record of a LOG callsite, padding and the batches of other processes are skipped.
+// A pid of -1 reads the batches of all processes. record has to hold the last record read from the stream.
+RecordStatus read_record(FILE *log_file, const ProgramSet *programs, int64_t pid, RecordStream *stream,
+                         DecodedRecord *record) {
+    if (stream->compact) return read_record_compact(log_file, programs, stream, record);
+
+    int32_t current_id;
+
+    while (read_binary_i32(&current_id, log_file)) {
+        if (current_id == CSL_RECORD_PADDING) {
+            uint32_t padding = 0;
+            read_binary_u32(&padding, log_file);
+            fseek(log_file, padding, SEEK_CUR);
+            continue;
+        }
+        if (current_id == CSL_RECORD_BATCH) {
+            // The records of the batch follow directly, batches of other processes are skipped as a whole
+            uint32_t batch_pid = 0;
+            uint32_t byte_count = 0;
+            read_binary_u32(&batch_pid, log_file);
+            read_binary_u32(&byte_count, log_file);
+            if (pid >= 0 && batch_pid != pid) fseek(log_file, byte_count, SEEK_CUR);
+            continue;
+        }
+        if (current_id == CSL_RECORD_PROCESS) {
+            uint32_t process_pid = 0;
+            char process_build_id[32];
+            read_binary_u32(&process_pid, log_file);
+            if (fread(process_build_id, 1, sizeof process_build_id, log_file) != sizeof process_build_id) {
+                return RECORD_TRUNCATED;
+            }
+            bool wanted = pid < 0 || process_pid == pid;
+            if (wanted && !stream->build_id_reported && !program_set_has_build_id(programs, process_build_id)) {
+                printf("Warning: process %u was not built from the program, its records may be converted wrong\n",
+                       process_pid);
+                stream->build_id_reported = true;
+            }
+            continue;
+        }
+        if (current_id == CSL_RECORD_REPEAT) {
+            uint32_t count = 0;
+            uint32_t first = 0;
+            uint32_t last = 0;
+            read_binary_u32(&count, log_file);
+            read_binary_u32(&first, log_file);
+            if (read_binary_u32(&last, log_file) != sizeof last) return RECORD_TRUNCATED;
+            if (read_repeat(stream, record, count, first, last)) return RECORD_READ;
+            continue;
+        }
+        if (current_id == CSL_RECORD_MODULE) {
+            if (!read_module(log_file, programs)) return RECORD_TRUNCATED;
+            continue;
+        }
+
+        arena_reset(&stream->strings);
+        uint32_t callsite_index = 0;
+        read_binary_u32(&callsite_index, log_file);
+        if (read_binary_u32(&record->timestamp, log_file) != sizeof record->timestamp) return RECORD_TRUNCATED;
+
+        RecordStatus status = resolve_callsite(programs, current_id, callsite_index, record);
+        if (status != RECORD_READ) return status;
+        LogHeader *h = record->list->headers[record->h_index];
+
+        for (size_t i = 0; i < h->arg_count; ++i) {
+            if (read_binary_logging_value(&record->values[i], h->types[i], &stream->strings, log_file) == 0) {
+                return RECORD_TRUNCATED;
+            }
+        }
+        record->repeat_count = 0;
+        stream->has_previous = true;
+        return RECORD_READ;
+    }
+    return RECORD_END;
+}
+
+// An incomplete last record is expected while the program still writes the log
+static void report_truncated_record(const char *log_name) {
+    printf("The last record of %s is incomplete, it is skipped\n", log_name);
+}
+
+// Converts a record, a repeat record either as one message or as the repeated message spread evenly over the
+// time of the repetitions
+void handle_record(FileFormatter *formatter, enum OutputFormat format, DecodedRecord *record) {
+    const HeaderList *list = record->list;
+    if (record->repeat_count == 0) {
+        handle_message(formatter, format, list, record->h_index, record->timestamp, record->values);
+        formatter->msg_count += 1;
+        return;
+    }
+
+    if (!formatter->expand_repeats) {
+        const LogHeader *h = list->headers[record->h_index];
+        char location[256];
+        snprintf(location, sizeof location, "%s:%d", h->filename.data, h->line);
+        LoggingValueU values[] = {
+            {.val_cstring = location},
+            {.val_uint = record->repeat_count},
+            {.val_uint = record->repeat_timestamp},
+        };
+        size_t h_index = list->repeat_index + h->level;
+        handle_message(formatter, format, list, h_index, record->timestamp, values);
+        formatter->msg_count += 1;
+        return;
+    }
+
+    uint32_t duration = record->timestamp - record->repeat_timestamp;
+    uint32_t steps = record->repeat_count > 1 ? record->repeat_count - 1 : 1;
+    for (uint32_t i = 0; i < record->repeat_count; ++i) {
+        uint32_t timestamp = record->repeat_timestamp + (uint32_t)((uint64_t)duration * i / steps);
+        handle_message(formatter, format, list, record->h_index, timestamp, record->values);
+        formatter->msg_count += 1;
+    }
+}
+
+// Converts all records until the end of log_file, returns false if the records can't be decoded.
+// record keeps the last record between calls for the repeat records.
+bool decode_records(FILE *log_file, const ProgramSet *programs, RecordStream *stream, DecodedRecord *record,
+                    FileFormatter *formatter, enum OutputFormat format, int64_t pid) {
+    RecordStatus status;
+
+    while ((status = read_record(log_file, programs, pid, stream, record)) == RECORD_READ) {
+        handle_record(formatter, format, record);
+    }
+    return status == RECORD_END;
+}
+
+typedef enum: uint8_t {
+    STAGE_ELF_LOAD,
+    STAGE_HEADER_DISCOVERY,
+    STAGE_DECODE,
+    STAGE_FORMAT,
+    STAGE_COUNT
+} Stage;
+
+static const char *STAGE_NAMES[] = {
+        "elf load",
+        "header discovery",
+        "decode",
+        "decode + format",
+};
+static_assert(sizeof STAGE_NAMES == sizeof(STAGE_NAMES[0]) * STAGE_COUNT);
+
+// Wall clock time of each stage of a conversion, with the bytes and records it processed
+typedef struct {
+    double seconds[STAGE_COUNT];
+    uint64_t byte_count[STAGE_COUNT];
+    uint64_t record_count[STAGE_COUNT];
+} StageTimings;
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t file_byte_count(const char *name) {
+    struct stat file_stat;
+    return stat(name, &file_stat) == 0 ? (uint64_t)file_stat.st_size : 0;
+}
+
+void write_stage_timings(FILE *f, const StageTimings *timings) {
+    fprintf(f, "%-18s %12s %12s %14s\n", "stage", "ms", "MB/s", "records/s");
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        double seconds = timings->seconds[i] > 0 ? timings->seconds[i] : 1e-9;
+        fprintf(f, "%-18s %12.3f %12.1f", STAGE_NAMES[i], timings->seconds[i] * 1e3,
+                (double)timings->byte_count[i] / seconds / 1e6);
+        if (timings->record_count[i] > 0) {
+            fprintf(f, " %14.0f\n", (double)timings->record_count[i] / seconds);
+        } else {
+            fprintf(f, " %14s\n", "-");
+        }
+    }
+}
+
+// timings is nullptr or receives the time of the ELF load and the header discovery, the header dump is left out then
+void load_program(ProgramImage *program, const char *name, enum OutputFormat format, StageTimings *timings) {
+    *program = (ProgramImage) {.name = name};
+
+    double start = monotonic_seconds();
+    program->file_content = read_file_content(name);
+
+    MemoryView data_section = {};
+    uint64_t data_address = 0;
+    parse_elf_section(program->file_content, &data_section, &data_address, &program->build_id);
+    program->module_key = csl_module_key(program->build_id.data, program->build_id.byte_count);
+    double loaded = monotonic_seconds();
+
+    build_header_list(&program->list, data_section, data_address, program->module_key, program->file_content,
+                      timings == nullptr);
+    prepare_header_list(&program->list, format);
+
+    if (timings != nullptr) {
+        uint64_t byte_count = file_byte_count(name);
+        timings->seconds[STAGE_ELF_LOAD] += loaded - start;
+        timings->byte_count[STAGE_ELF_LOAD] += byte_count;
+        timings->seconds[STAGE_HEADER_DISCOVERY] += monotonic_seconds() - loaded;
+        timings->byte_count[STAGE_HEADER_DISCOVERY] += data_section.byte_count;
+    }
+}
+
+void free_program(ProgramImage *program) {
+    header_list_free(&program->list);
+    free(program->file_content);
+}
+
+// A log file and its next record
+typedef struct {
+    const char *name;
+    FILE *file;
+    RecordStream stream;
+    DecodedRecord record;
+} LogSource;
+
+// Only decodes the records of all sources, without formatting them, and rewinds the sources afterwards
+bool time_decode(const ProgramSet *programs, LogSource *sources, size_t source_count, int64_t pid,
+                 StageTimings *timings) {
+    double start = monotonic_seconds();
+    bool ok = true;
+
+    for (size_t i = 0; i < source_count; ++i) {
+        RecordStatus status;
+        while ((status = read_record(sources[i].file, programs, pid, &sources[i].stream,
+                                     &sources[i].record)) == RECORD_READ) {
+            timings->record_count[STAGE_DECODE] += 1;
+        }
+        if (status == RECORD_UNKNOWN_ID) ok = false;
+        timings->byte_count[STAGE_DECODE] += file_byte_count(sources[i].name);
+    }
+    timings->seconds[STAGE_DECODE] = monotonic_seconds() - start;
+
+    for (size_t i = 0; i < source_count; ++i) {
+        fseek(sources[i].file, LOGGING_FILE_HEADER_SIZE, SEEK_SET);
+        sources[i].stream.size = 0;
+        sources[i].stream.timestamp = 0;
+        sources[i].stream.has_previous = false;
+    }
+    return ok;
+}
+
+// Timestamps are milliseconds truncated to 32 bits, the difference still orders them across a wrap around
+static bool log_source_before(const LogSource *sources, uint32_t a, uint32_t b) {
+    int32_t difference = (int32_t)(sources[a].record.timestamp - sources[b].record.timestamp);
+    if (difference != 0) return difference < 0;
+    return a < b;
+}
+
+static void heap_sift_down(const LogSource *sources, uint32_t *heap, size_t size, size_t i) {
+    while (true) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && log_source_before(sources, heap[left], heap[smallest])) smallest = left;
+        if (right < size && log_source_before(sources, heap[right], heap[smallest])) smallest = right;
+        if (smallest == i) return;
+
+        uint32_t tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Converts the records of all sources ordered by timestamp, records with the same timestamp keep the order of
+// the sources. Only the next record of each source is kept in memory.
+bool merge_log_sources(const ProgramSet *programs, LogSource *sources, size_t source_count,
+                       FileFormatter *formatter, enum OutputFormat format, int64_t pid) {
+    uint32_t *heap = malloc(source_count * sizeof(heap[0]));
+    size_t heap_size = 0;
+    bool ok = true;
+
+    for (uint32_t i = 0; i < source_count; ++i) {
+        RecordStatus status = read_record(sources[i].file, programs, pid, &sources[i].stream, &sources[i].record);
+        if (status == RECORD_READ) heap[heap_size++] = i;
+        if (status == RECORD_UNKNOWN_ID) ok = false;
+        if (status == RECORD_TRUNCATED) report_truncated_record(sources[i].name);
+    }
+    for (size_t i = heap_size / 2; i-- > 0;) {
+        heap_sift_down(sources, heap, heap_size, i);
+    }
+
+    while (heap_size > 0) {
+        LogSource *source = &sources[heap[0]];
+
+        handle_record(formatter, format, &source->record);
+
+        RecordStatus status = read_record(source->file, programs, pid, &source->stream, &source->record);
+        if (status != RECORD_READ) {
+            if (status == RECORD_UNKNOWN_ID) {
+                printf("Skipping the rest of %s\n", source->name);
+                ok = false;
+            }
+            if (status == RECORD_TRUNCATED) report_truncated_record(source->name);
+            heap[0] = heap[--heap_size];
+        }
+        heap_sift_down(sources, heap, heap_size, 0);
+    }
+
+    free(heap);
+    return ok;
+}
+
+static volatile sig_atomic_t STOP_REQUESTED = 0;
+
+static void stop_signal_handler(int signo) {
+    (void)signo;
+    STOP_REQUESTED = 1;
+}
+
+// Follows the shared memory ring of a CSL_SINK_SHM logger until the logger is closed or Ctrl+C is pressed
+bool attach_shared_memory(const char *shm_name, const ProgramSet *programs, FileFormatter *formatter,
+                          enum OutputFormat format, int64_t pid) {
+    signal(SIGINT, stop_signal_handler);
+    signal(SIGTERM, stop_signal_handler);
+
+    int fd = -1;
+    struct stat shm_stat = {};
+    while (!STOP_REQUESTED) {
+        if (fd < 0) fd = shm_open(shm_name, O_RDONLY, 0);
+        if (fd >= 0 && fstat(fd, &shm_stat) == 0 && (size_t)shm_stat.st_size > sizeof(ShmRingHeader)) break;
+        usleep(100 * 1000);
+    }
+    if (STOP_REQUESTED) {
+        if (fd >= 0) close(fd);
+        return true;
+    }
+
+    const char *memory = mmap(nullptr, shm_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        printf("Can't map shared memory %s\n", shm_name);
+        return false;
+    }
+
+    const ShmRingHeader *ring = (const ShmRingHeader *)memory;
+    while (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != CSL_SHM_RING_MAGIC_NUMBER && !STOP_REQUESTED) {
+        usleep(1000);
+    }
+
+    FILE *header_file = fmemopen((void *)ring->file_header, LOGGING_FILE_HEADER_SIZE, "rb");
+    uint32_t flags = 0;
+    bool header_ok = read_log_file_header(header_file, shm_name, programs, &flags);
+    fclose(header_file);
+    if (!header_ok) {
+        munmap((void *)memory, shm_stat.st_size);
+        return false;
+    }
+
+    const char *data = memory + ring->data_offset;
+    uint64_t capacity = ring->capacity;
+    char *chunk = malloc(capacity);
+
+    // Start at the oldest record if nothing was overwritten yet, else with the next one
+    uint64_t read_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+    if (read_pos <= capacity) read_pos = 0;
+
+    uint64_t overrun_count = 0;
+    uint64_t lost_bytes = 0;
+    bool ok = true;
+    RecordStream stream = {};
+    DecodedRecord record = {};
+
+    while (!STOP_REQUESTED && ok) {
+        bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+
+        if (write_pos == read_pos) {
+            if (closed) break;
+            usleep(10 * 1000);
+            continue;
+        }
+
+        size_t byte_count = write_pos - read_pos;
+        if (byte_count <= capacity) {
+            size_t start = read_pos % capacity;
+            size_t first = byte_count < capacity - start ? byte_count : capacity - start;
+            memcpy(chunk, data + start, first);
+            memcpy(chunk + first, data, byte_count - first);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+
+        // The copy is only valid if the producer did not start to overwrite it in the meantime
+        uint64_t reserve_pos = __atomic_load_n(&ring->reserve_pos, __ATOMIC_RELAXED);
+        if (byte_count > capacity || reserve_pos - read_pos > capacity) {
+            uint64_t resume_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+            overrun_count += 1;
+            lost_bytes += resume_pos - read_pos;
+            fprintf(stderr, "Overrun: the producer overwrote %lu bytes before they could be read\n",
+                    (unsigned long)(resume_pos - read_pos));
+            read_pos = resume_pos;
+            stream.has_previous = false;
+            continue;
+        }
+
+        FILE *chunk_file = fmemopen(chunk, byte_count, "rb");
+        ok = decode_records(chunk_file, programs, &stream, &record, formatter, format, pid);
+        fclose(chunk_file);
+        flush_formatter(formatter, format);
+
+        read_pos = write_pos;
+    }
+
+    if (overrun_count > 0) {
+        printf("Detected %lu overruns, %lu bytes of records were lost\n", (unsigned long)overrun_count,
+               (unsigned long)lost_bytes);
+    }
+
+    record_stream_free(&stream);
+    free(chunk);
+    munmap((void *)memory, shm_stat.st_size);
+    return ok;
+}
+
 int main(int argc, char **argv) {
     if (args_find_position("--help", argc, argv) > 0) {
         print_help(argc, argv);
         return EXIT_SUCCESS;
     }
 
-    const char *target_program_name = args_get_value("--program", argc, argv);
-    const char *log_file_name = args_get_value("--log", argc, argv);
+    const char **program_names = calloc(argc, sizeof(program_names[0]));
+    const char **log_file_names = calloc(argc, sizeof(log_file_names[0]));
+    int program_count = args_get_values("--program", argc, argv, program_names);
+    int log_count = args_get_values("--log", argc, argv, log_file_names);
+    const char *shm_name = args_get_value("--attach", argc, argv);
 
-    if (target_program_name == nullptr || log_file_name == nullptr) {
+    if (program_count == 0 || (log_count == 0) == (shm_name == nullptr)) {
         print_help(argc, argv);
         return EXIT_FAILURE;
     }
 
     const char *output_filename = args_get_value("--outfile", argc, argv);
     const char *wanted_fmt_str = args_get_value("--format", argc, argv);
+    if (args_find_position("--stats", argc, argv) > 0) {
+        bool json = wanted_fmt_str != nullptr && strcmp(wanted_fmt_str, "json") == 0;
+        wanted_fmt_str = json ? "stats-json" : "stats";
+    }
+    const char *interval_str = args_get_value("--interval", argc, argv);
+    const char *page_size_str = args_get_value("--page-size", argc, argv);
+    const char *pid_str = args_get_value("--pid", argc, argv);
+    int64_t pid = pid_str != nullptr ? strtoll(pid_str, nullptr, 10) : -1;
+    bool print_timings = args_find_position("--timings", argc, argv) > 0;
+    bool expand_repeats = args_find_position("--expand-repeats", argc, argv) > 0;
+    StageTimings timings = {};
     enum OutputFormat wanted_format = OUTPUT_FMT_STRING;
 
     if (wanted_fmt_str != nullptr) {
@@ -669,79 +1830,76 @@ int main(int argc, char **argv) {
         }
     }
 
-    char *file_content = read_file_content(target_program_name);
-
-    MemoryView data_section = {};
-    MemoryView build_id = {};
-    parse_elf_section(file_content, &data_section, &build_id);
-
-    HeaderList list;
-    build_header_list(&list, data_section, file_content);
-
-    FILE *log_file = fopen(log_file_name, "rb");
-
-    FileFormatter formatter = {};
-    formatter.filename = output_filename;
-
-    init_formatter(&formatter, wanted_format);
-
-    uint32_t magic_num;
-    read_binary_u32(&magic_num, log_file);
-    assert(magic_num == LOGGING_FILE_HEADER_MAGIC_NUMBER);
-
-    uint32_t version_number;
-    read_binary_u32(&version_number, log_file);
-    assert(version_number == LOGGING_FILE_HEADER_VERSION_NUMBER);
-
-
-    char logging_build_id[32] = {};
-    (void)!fread(&logging_build_id, 1, 32, log_file); //TODO: handle error
-
-    if (build_id.byte_count > 0
-        && (build_id.byte_count >= 32 || memcmp(build_id.data, logging_build_id, build_id.byte_count) != 0)
-        ) {
-        puts("Warning: mismatch of build ids detected!");
-        printf("ID in target program %s", target_program_name);
-        print_n_bytes("", build_id.data,  build_id.byte_count);
-
-        printf("ID log file %s was produced with", log_file_name);
-        print_n_bytes("", logging_build_id,  build_id.byte_count);
-        puts("===============================================================================");
-//        return EXIT_FAILURE;
+    // All programs serve all log files, the same program given several times is only loaded once
+    ProgramSet programs = {.programs = calloc(program_count, sizeof(programs.programs[0]))};
+    for (int i = 0; i < program_count; ++i) {
+        size_t p = 0;
+        while (p < programs.count && strcmp(programs.programs[p].name, program_names[i]) != 0) ++p;
+        if (p == programs.count) {
+            load_program(&programs.programs[programs.count++], program_names[i], wanted_format,
+                         print_timings ? &timings : nullptr);
+        }
     }
-
-    for (int i = 0; i < LOGGING_FILE_HEADER_RESERVED_COUNT; ++i) {
-        uint8_t dummy;
-        read_binary_u8(&dummy, log_file);
+    program_set_index(&programs);
+
+    LogSource *sources = calloc(log_count, sizeof(sources[0]));
+    bool ok = true;
+    for (int i = 0; i < log_count && ok; ++i) {
+        sources[i].name = log_file_names[i];
+        sources[i].file = fopen(log_file_names[i], "rb");
+        if (sources[i].file == nullptr) {
+            printf("Can't open log file %s\n", log_file_names[i]);
+            ok = false;
+            continue;
+        }
+        uint32_t flags = 0;
+        ok = read_log_file_header(sources[i].file, log_file_names[i], &programs, &flags);
+        sources[i].stream.compact = (flags & CSL_FILE_FLAG_COMPACT) != 0;
     }
 
-    int32_t current_id;
-    uint32_t current_timestamp;
-
-    LoggingValueU current_values[CSL_MAX_ARG_COUNT];
-
-    while (read_binary_i32(&current_id, log_file)) {
-        read_binary_u32(&current_timestamp, log_file);
-//        printf("Log message with id %d and timestamp %u\n", current_id, current_timestamp);
-
-        uint32_t  h_index = header_list_lookup_by_id(&list, current_id);
-        LogHeader *h = list.headers[h_index];
-
-        for (size_t i = 0; i < h->arg_count; ++i) {
-            read_binary_logging_value(&current_values[i], h->types[i], log_file);
+    FileFormatter formatter = {};
+    formatter.filename = output_filename;
+    formatter.stats_interval_ms = interval_str != nullptr ? (uint32_t)strtoul(interval_str, nullptr, 10) : 1000;
+    formatter.html_page_size = page_size_str != nullptr ? (uint32_t)strtoul(page_size_str, nullptr, 10) : 1000;
+    // The statistics count every repetition
+    formatter.expand_repeats = expand_repeats || wanted_format == OUTPUT_FMT_STATS ||
+                               wanted_format == OUTPUT_FMT_STATS_JSON;
+
+    if (ok) {
+        double start = monotonic_seconds();
+        init_formatter(&formatter, wanted_format);
+
+        if (log_count > 0) {
+            if (print_timings) ok = time_decode(&programs, sources, log_count, pid, &timings);
+
+            ok = ok && merge_log_sources(&programs, sources, log_count, &formatter, wanted_format, pid);
+        } else {
+            ok = attach_shared_memory(shm_name, &programs, &formatter, wanted_format, pid);
         }
 
-        handle_message(&formatter, wanted_format, h, current_id, current_timestamp, current_values);
-        formatter.msg_count += 1;
+        deinit_formatter(&formatter, wanted_format);
+        printf("Wrote %zu messages to file %s\n", formatter.msg_count, formatter.filename);
 
-        for (size_t i = 0; i < h->arg_count; ++i) {
-            if (h->types[i] == TYPE_CSTRING) free((char *)current_values[i].val_cstring);
+        if (print_timings) {
+            // The decode-only pass of time_decode ran in between, it is not part of decoding with formatting
+            timings.seconds[STAGE_FORMAT] = monotonic_seconds() - start - timings.seconds[STAGE_DECODE];
+            timings.byte_count[STAGE_FORMAT] = timings.byte_count[STAGE_DECODE];
+            timings.record_count[STAGE_FORMAT] = formatter.msg_count;
+            write_stage_timings(stdout, &timings);
         }
     }
-    deinit_formatter(&formatter, wanted_format);
-    printf("Wrote %zu messages to file %s\n", formatter.msg_count, formatter.filename);
-    fclose(log_file);
 
-    header_list_free(&list);
-    free(file_content);
+    for (int i = 0; i < log_count; ++i) {
+        if (sources[i].file != nullptr) fclose(sources[i].file);
+        record_stream_free(&sources[i].stream);
+    }
+    for (size_t i = 0; i < programs.count; ++i) {
+        free_program(&programs.programs[i]);
+    }
+    free(programs.slots);
+    free(sources);
+    free(programs.programs);
+    free(log_file_names);
+    free(program_names);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,56 @@
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+
+#include "csl.h"
+
+typedef enum: uint8_t {
+    ESCAPE_JSON,
+    ESCAPE_XML,
+    ESCAPE_COUNT
+} EscapeMode;
+
+// Returns the index of the first byte at or after start that may need escaping, n if there is none.
+size_t escape_find(EscapeMode mode, const char *s, size_t n, size_t start);
+void escape_write(FILE *f, EscapeMode mode, const char *s, size_t n);
+// Returns a malloc'd, escaped copy of sv
+StringView escape_string_view(EscapeMode mode, StringView sv);
+
+typedef enum: uint8_t {
+    SEGMENT_LITERAL,
+    SEGMENT_ARG,
+} SegmentKind;
+
+typedef struct {
+    SegmentKind kind;
+    uint8_t arg;
+    // literal: range inside fmt_str, arg: printf conversion for the value
+    uint32_t offset;
+    uint32_t length;
+    char spec[12];
+} FormatSegment;
+
+// A fmt_str parsed once into literal runs and argument slots
+typedef struct {
+    size_t count;
+    FormatSegment *segments;
+    bool valid;
+} FormatProgram;
+
+// The scalar type of the elements of an array type (u8 for blobs), the type itself for the other types
+DataType data_type_element(DataType type);
+// Element index of an array value as a scalar value of type data_type_element(type)
+LoggingValueU logging_array_element(DataType type, LoggingArray array, size_t index);
+
+bool format_program_compile(FormatProgram *program, const LogHeader *header, char *error, size_t error_size);
+void format_program_free(FormatProgram *program);
+void format_program_run(FILE *f, const FormatProgram *program, const LogHeader *header, LoggingValueU *values);
+
+// Per callsite and per argument statistics, percentiles come from a log-linear histogram
+typedef struct StatsCollector StatsCollector;
+StatsCollector *stats_create(uint32_t interval_ms);
+void stats_free(StatsCollector *stats);
+void stats_add(StatsCollector *stats, const LogHeader *header, int64_t id, uint32_t timestamp,
+               const LoggingValueU *values);
+void stats_write_report(FILE *f, const StatsCollector *stats);
+void stats_write_json(FILE *f, const StatsCollector *stats);
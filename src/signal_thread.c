@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "csl_internal.h"
+
+// The handler only writes the signal number into a pipe, which is async signal safe, the callbacks run on a helper
+// thread that reads the pipe. They work in an idle process, where no message would ever pick up a flag.
+typedef struct {
+    pthread_mutex_t lock;
+    SignalCallback callbacks[NSIG];
+    // -1 until the thread is started, the write end is non-blocking so the handler never waits
+    int pipe[2];
+    bool atfork_installed;
+} SignalThread;
+
+static SignalThread SIGNALS = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pipe = {-1, -1},
+};
+
+static void signal_thread_handler(int signo) {
+    int saved_errno = errno;
+    unsigned char byte = (unsigned char)signo;
+    // A full pipe already holds a wakeup, the signal is not lost
+    (void)!write(SIGNALS.pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+
+static void *signal_thread_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned char signo;
+
+    while (true) {
+        ssize_t read_count = read(fd, &signo, 1);
+        if (read_count < 0 && errno == EINTR) continue;
+        if (read_count <= 0) return nullptr;
+
+        pthread_mutex_lock(&SIGNALS.lock);
+        SignalCallback callback = SIGNALS.callbacks[signo];
+        pthread_mutex_unlock(&SIGNALS.lock);
+        if (callback != nullptr) callback(signo);
+    }
+}
+
+// Needs the lock
+static bool signal_thread_start() {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return false;
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    // The watched signals are delivered to the other threads, never to the helper itself
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    bool ok = pthread_create(&thread, &attr, signal_thread_main, (void *)(intptr_t)fds[0]) == 0;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+    if (!ok) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    SIGNALS.pipe[0] = fds[0];
+    SIGNALS.pipe[1] = fds[1];
+    return true;
+}
+
+static void signal_thread_prepare_fork() {
+    pthread_mutex_lock(&SIGNALS.lock);
+}
+
+static void signal_thread_after_fork_parent() {
+    pthread_mutex_unlock(&SIGNALS.lock);
+}
+
+// The helper is not copied by fork and the pipe is shared with the parent, the child gets its own
+static void signal_thread_after_fork_child() {
+    if (SIGNALS.pipe[0] >= 0) {
+        close(SIGNALS.pipe[0]);
+        close(SIGNALS.pipe[1]);
+        SIGNALS.pipe[0] = -1;
+        SIGNALS.pipe[1] = -1;
+        signal_thread_start();
+    }
+    pthread_mutex_unlock(&SIGNALS.lock);
+}
+
+bool signal_thread_watch(int signo, SignalCallback callback) {
+    if (signo <= 0 || signo >= NSIG) return false;
+
+    pthread_mutex_lock(&SIGNALS.lock);
+    if (!SIGNALS.atfork_installed) {
+        pthread_atfork(signal_thread_prepare_fork, signal_thread_after_fork_parent, signal_thread_after_fork_child);
+        SIGNALS.atfork_installed = true;
+    }
+    bool ok = SIGNALS.pipe[0] >= 0 || signal_thread_start();
+    if (ok) SIGNALS.callbacks[signo] = callback;
+    pthread_mutex_unlock(&SIGNALS.lock);
+    if (!ok) return false;
+
+    struct sigaction action = {.sa_handler = signal_thread_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    return sigaction(signo, &action, nullptr) == 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "csl_internal.h"
+
+struct AppendWriter {
+    int fd;
+    pthread_mutex_t lock;
+
+    // Starts with space for the batch record, the records of this process follow
+    char *buffer;
+    size_t buffer_size;
+    size_t fill;
+
+    AppendWriter *next;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    AppendWriter *writers;
+    bool atfork_installed;
+} AppendWriterList;
+
+static AppendWriterList WRITERS = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool write_all(int fd, const char *data, size_t byte_count) {
+    while (byte_count > 0) {
+        ssize_t written = write(fd, data, byte_count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        byte_count -= written;
+    }
+    return true;
+}
+
+// Needs the lock of the writer
+static void append_writer_write_batch(AppendWriter *w) {
+    if (w->fill == CSL_BATCH_RECORD_SIZE) return;
+
+    char *p = encode_binary_i32(w->buffer, CSL_RECORD_BATCH);
+    p = encode_binary_u32(p, (uint32_t)getpid());
+    encode_binary_u32(p, (uint32_t)(w->fill - CSL_BATCH_RECORD_SIZE));
+
+    // A single write to a file opened with O_APPEND is not interleaved with the writes of other processes
+    if (!write_all(w->fd, w->buffer, w->fill)) {
+        fprintf(stderr, "csl: writing a batch of %zu bytes failed: %s\n", w->fill, strerror(errno));
+    }
+    w->fill = CSL_BATCH_RECORD_SIZE;
+}
+
+// Records buffered before a fork are written by the parent only, the child starts with an empty buffer
+static void append_writers_prepare_fork() {
+    pthread_mutex_lock(&WRITERS.lock);
+    for (AppendWriter *w = WRITERS.writers; w != nullptr; w = w->next) {
+        pthread_mutex_lock(&w->lock);
+        append_writer_write_batch(w);
+    }
+}
+
+static void append_writers_after_fork() {
+    for (AppendWriter *w = WRITERS.writers; w != nullptr; w = w->next) {
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&WRITERS.lock);
+}
+
+// Only the first process writes the file header, a prepared file is linked into place atomically
+static int open_shared_file(const char *filename, const char *file_header) {
+    char temp_name[4096];
+    snprintf(temp_name, sizeof temp_name, "%s.%d.tmp", filename, (int)getpid());
+
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        bool ok = write_all(fd, file_header, LOGGING_FILE_HEADER_SIZE);
+        close(fd);
+        if (ok && link(temp_name, filename) != 0 && errno != EEXIST) ok = false;
+        unlink(temp_name);
+        if (!ok) return -1;
+    }
+
+    return open(filename, O_WRONLY | O_APPEND);
+}
+
+AppendWriter *append_writer_create(const char *filename, size_t buffer_size, const char *file_header) {
+    AppendWriter *w = calloc(1, sizeof *w);
+    if (w == nullptr) return nullptr;
+
+    w->buffer_size = buffer_size;
+    w->buffer = malloc(buffer_size);
+    w->fill = CSL_BATCH_RECORD_SIZE;
+    w->fd = open_shared_file(filename, file_header);
+
+    if (w->buffer == nullptr || w->fd < 0) {
+        if (w->fd >= 0) close(w->fd);
+        free(w->buffer);
+        free(w);
+        return nullptr;
+    }
+    pthread_mutex_init(&w->lock, nullptr);
+
+    pthread_mutex_lock(&WRITERS.lock);
+    if (!WRITERS.atfork_installed) {
+        pthread_atfork(append_writers_prepare_fork, append_writers_after_fork, append_writers_after_fork);
+        WRITERS.atfork_installed = true;
+    }
+    w->next = WRITERS.writers;
+    WRITERS.writers = w;
+    pthread_mutex_unlock(&WRITERS.lock);
+
+    return w;
+}
+
+void append_writer_write(AppendWriter *w, const char *data, size_t byte_count) {
+    pthread_mutex_lock(&w->lock);
+
+    if (w->fill + byte_count > w->buffer_size) append_writer_write_batch(w);
+
+    if (CSL_BATCH_RECORD_SIZE + byte_count > w->buffer_size) {
+        // A record larger than the buffer gets a batch of its own
+        char batch[CSL_BATCH_RECORD_SIZE];
+        char *p = encode_binary_i32(batch, CSL_RECORD_BATCH);
+        p = encode_binary_u32(p, (uint32_t)getpid());
+        encode_binary_u32(p, (uint32_t)byte_count);
+
+        char *large = malloc(sizeof batch + byte_count);
+        if (large != nullptr) {
+            memcpy(large, batch, sizeof batch);
+            memcpy(large + sizeof batch, data, byte_count);
+            write_all(w->fd, large, sizeof batch + byte_count);
+            free(large);
+        }
+    } else {
+        memcpy(w->buffer + w->fill, data, byte_count);
+        w->fill += byte_count;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+void append_writer_flush(AppendWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    append_writer_write_batch(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void append_writer_close(AppendWriter *w) {
+    pthread_mutex_lock(&WRITERS.lock);
+    for (AppendWriter **it = &WRITERS.writers; *it != nullptr; it = &(*it)->next) {
+        if (*it == w) {
+            *it = w->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&WRITERS.lock);
+
+    append_writer_flush(w);
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    free(w->buffer);
+    free(w);
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csl_internal.h"
+
+// Every record is kept as a u32 byte count followed by the record, so the oldest complete record can be found
+// after the ring wrapped around. Overwritten records are dropped as a whole.
+constexpr size_t FRAME_HEADER_SIZE = sizeof(uint32_t);
+
+struct FlightRecorder {
+    char *name;
+    char file_header[LOGGING_FILE_HEADER_SIZE];
+
+    char *data;
+    size_t capacity;
+    // Positions grow without wrapping, the frames between oldest_pos and write_pos are complete
+    uint64_t oldest_pos;
+    uint64_t write_pos;
+
+    uint32_t dump_count;
+    uint64_t dropped;
+};
+
+FlightRecorder *flight_recorder_create(const char *name, size_t capacity, const char *file_header) {
+    FlightRecorder *recorder = calloc(1, sizeof *recorder);
+    if (recorder == nullptr) return nullptr;
+
+    recorder->name = strdup(name);
+    recorder->data = malloc(capacity);
+    recorder->capacity = capacity;
+    if (recorder->name == nullptr || recorder->data == nullptr) {
+        free(recorder->name);
+        free(recorder->data);
+        free(recorder);
+        return nullptr;
+    }
+    memcpy(recorder->file_header, file_header, LOGGING_FILE_HEADER_SIZE);
+    return recorder;
+}
+
+static void ring_copy_in(FlightRecorder *recorder, uint64_t pos, const char *data, size_t byte_count) {
+    size_t start = pos % recorder->capacity;
+    size_t first = byte_count < recorder->capacity - start ? byte_count : recorder->capacity - start;
+    memcpy(recorder->data + start, data, first);
+    memcpy(recorder->data, data + first, byte_count - first);
+}
+
+static void ring_copy_out(const FlightRecorder *recorder, uint64_t pos, char *data, size_t byte_count) {
+    size_t start = pos % recorder->capacity;
+    size_t first = byte_count < recorder->capacity - start ? byte_count : recorder->capacity - start;
+    memcpy(data, recorder->data + start, first);
+    memcpy(data + first, recorder->data, byte_count - first);
+}
+
+static uint32_t frame_size(const FlightRecorder *recorder, uint64_t pos) {
+    char bytes[FRAME_HEADER_SIZE];
+    ring_copy_out(recorder, pos, bytes, sizeof bytes);
+
+    uint32_t size;
+    memcpy(&size, bytes, sizeof size);
+    return size;
+}
+
+// Needs to be serialized by the caller, only copies the record into memory
+void flight_recorder_write(FlightRecorder *recorder, const char *data, size_t byte_count) {
+    size_t needed = FRAME_HEADER_SIZE + byte_count;
+    if (needed > recorder->capacity) {
+        recorder->dropped += 1;
+        return;
+    }
+
+    while (recorder->write_pos + needed - recorder->oldest_pos > recorder->capacity) {
+        recorder->oldest_pos += FRAME_HEADER_SIZE + frame_size(recorder, recorder->oldest_pos);
+    }
+
+    char frame_header[FRAME_HEADER_SIZE];
+    encode_binary_u32(frame_header, (uint32_t)byte_count);
+    ring_copy_in(recorder, recorder->write_pos, frame_header, sizeof frame_header);
+    ring_copy_in(recorder, recorder->write_pos + FRAME_HEADER_SIZE, data, byte_count);
+    recorder->write_pos += needed;
+}
+
+static bool write_ring_bytes(const FlightRecorder *recorder, uint64_t pos, size_t byte_count, FILE *f) {
+    size_t start = pos % recorder->capacity;
+    size_t first = byte_count < recorder->capacity - start ? byte_count : recorder->capacity - start;
+    return fwrite(recorder->data + start, 1, first, f) == first &&
+           fwrite(recorder->data, 1, byte_count - first, f) == byte_count - first;
+}
+
+// Writes the file header and the records in the ring, oldest first, and empties the ring.
+// A filename of nullptr writes to "<name>.<n>" with n counting the dumps of this recorder.
+bool flight_recorder_dump(FlightRecorder *recorder, const char *filename) {
+    char numbered_name[4096];
+    if (filename == nullptr) {
+        snprintf(numbered_name, sizeof numbered_name, "%s.%u", recorder->name, recorder->dump_count++);
+        filename = numbered_name;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (f == nullptr) {
+        fprintf(stderr, "csl: can't open %s for the flight recorder dump\n", filename);
+        return false;
+    }
+
+    bool ok = fwrite(recorder->file_header, 1, LOGGING_FILE_HEADER_SIZE, f) == LOGGING_FILE_HEADER_SIZE;
+    for (uint64_t pos = recorder->oldest_pos; ok && pos < recorder->write_pos;) {
+        uint32_t size = frame_size(recorder, pos);
+        ok = write_ring_bytes(recorder, pos + FRAME_HEADER_SIZE, size, f);
+        pos += FRAME_HEADER_SIZE + size;
+    }
+    ok = fclose(f) == 0 && ok;
+
+    recorder->oldest_pos = recorder->write_pos;
+    return ok;
+}
+
+void flight_recorder_close(FlightRecorder *recorder) {
+    if (recorder->dropped > 0) {
+        fprintf(stderr, "csl: dropped %lu records larger than the flight recorder %s\n",
+                (unsigned long)recorder->dropped, recorder->name);
+    }
+    free(recorder->data);
+    free(recorder->name);
+    free(recorder);
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "csl_internal.h"
+
+struct ShmRing {
+    char *name;
+    ShmRingHeader *header;
+    char *data;
+    size_t mapped_size;
+    uint64_t dropped;
+};
+
+ShmRing *shm_ring_create(const char *name, size_t capacity, const char *file_header) {
+    ShmRing *ring = calloc(1, sizeof *ring);
+    if (ring == nullptr) return nullptr;
+
+    size_t data_offset = (sizeof(ShmRingHeader) + 63) & ~(size_t)63;
+    ring->mapped_size = data_offset + capacity;
+    ring->name = strdup(name);
+
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)ring->mapped_size) != 0) {
+        if (fd >= 0) close(fd);
+        free(ring->name);
+        free(ring);
+        return nullptr;
+    }
+
+    void *memory = mmap(nullptr, ring->mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(name);
+        free(ring->name);
+        free(ring);
+        return nullptr;
+    }
+
+    ring->header = memory;
+    ring->data = (char *)memory + data_offset;
+
+    ring->header->data_offset = data_offset;
+    ring->header->capacity = capacity;
+    memcpy(ring->header->file_header, file_header, LOGGING_FILE_HEADER_SIZE);
+    // Consumers wait for the magic number, so it is published last
+    __atomic_store_n(&ring->header->magic, CSL_SHM_RING_MAGIC_NUMBER, __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+// Needs to be serialized by the caller, the ring supports a single writer
+void shm_ring_write(ShmRing *ring, const char *data, size_t byte_count) {
+    uint64_t capacity = ring->header->capacity;
+    if (byte_count > capacity) {
+        ring->dropped += 1;
+        return;
+    }
+
+    uint64_t pos = __atomic_load_n(&ring->header->write_pos, __ATOMIC_RELAXED);
+
+    // A consumer that still reads the bytes overwritten now detects this by the reserve position
+    __atomic_store_n(&ring->header->reserve_pos, pos + byte_count, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t start = pos % capacity;
+    size_t first = byte_count < capacity - start ? byte_count : capacity - start;
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, data + first, byte_count - first);
+
+    __atomic_store_n(&ring->header->write_pos, pos + byte_count, __ATOMIC_RELEASE);
+}
+
+void shm_ring_close(ShmRing *ring) {
+    __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+    if (ring->dropped > 0) {
+        fprintf(stderr, "csl: dropped %lu records larger than the shared memory ring %s\n",
+                (unsigned long)ring->dropped, ring->name);
+    }
+
+    // Consumers that are attached keep their mapping and see the closed flag
+    munmap(ring->header, ring->mapped_size);
+    shm_unlink(ring->name);
+    free(ring->name);
+    free(ring);
+}
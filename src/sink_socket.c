@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "csl_internal.h"
+
+// An unreachable collector is tried again at most once per interval, batches wait in the backlog meanwhile
+constexpr uint64_t RECONNECT_INTERVAL_MS = 1000;
+// Every batch in the backlog is kept as a u32 byte count followed by the batch
+constexpr size_t BACKLOG_FRAME_HEADER_SIZE = sizeof(uint32_t);
+
+struct SocketWriter {
+    struct sockaddr_un address;
+    char file_header[LOGGING_FILE_HEADER_SIZE];
+    // -1 while not connected
+    int fd;
+    uint64_t last_connect_ms;
+    pthread_mutex_t lock;
+
+    char *buffer;
+    size_t buffer_size;
+    size_t fill;
+
+    // Batches that could not be sent yet, oldest first
+    char *backlog;
+    size_t backlog_capacity;
+    size_t backlog_fill;
+
+    uint64_t dropped_batches;
+    uint64_t dropped_records;
+
+    SocketWriter *next;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    SocketWriter *writers;
+    bool atfork_installed;
+} SocketWriterList;
+
+static SocketWriterList WRITERS = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Needs the lock of the writer. Never blocks, so a slow collector can't stall the producers: a full socket buffer
+// keeps the connection and the caller keeps the batch, any other failure closes the connection.
+static bool send_message(SocketWriter *w, const char *data, size_t byte_count) {
+    if (w->fd < 0) return false;
+
+    // One message per batch, the collector never sees a partial batch
+    while (send(w->fd, data, byte_count, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+        close(w->fd);
+        w->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static uint32_t backlog_frame_size(const SocketWriter *w, size_t pos) {
+    uint32_t size;
+    memcpy(&size, w->backlog + pos, sizeof size);
+    return size;
+}
+
+// Needs the lock of the writer, drops the oldest batches if the backlog is full
+static void backlog_push(SocketWriter *w, const char *data, size_t byte_count) {
+    size_t needed = BACKLOG_FRAME_HEADER_SIZE + byte_count;
+    if (needed > w->backlog_capacity) {
+        w->dropped_batches += 1;
+        return;
+    }
+
+    size_t dropped = 0;
+    while (w->backlog_fill - dropped + needed > w->backlog_capacity) {
+        dropped += BACKLOG_FRAME_HEADER_SIZE + backlog_frame_size(w, dropped);
+        w->dropped_batches += 1;
+    }
+    memmove(w->backlog, w->backlog + dropped, w->backlog_fill - dropped);
+    w->backlog_fill -= dropped;
+
+    encode_binary_u32(w->backlog + w->backlog_fill, (uint32_t)byte_count);
+    memcpy(w->backlog + w->backlog_fill + BACKLOG_FRAME_HEADER_SIZE, data, byte_count);
+    w->backlog_fill += needed;
+}
+
+// Needs the lock of the writer, returns true if the collector is connected and the backlog is sent
+static bool socket_writer_connect(SocketWriter *w) {
+    if (w->fd < 0) {
+        uint64_t now = monotonic_ms();
+        if (w->last_connect_ms != 0 && now - w->last_connect_ms < RECONNECT_INTERVAL_MS) return false;
+        w->last_connect_ms = now;
+
+        // Non-blocking, a collector with a full listen queue fails the connect instead of stalling it
+        w->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (w->fd < 0) return false;
+        if (connect(w->fd, (struct sockaddr *)&w->address, sizeof w->address) != 0) {
+            close(w->fd);
+            w->fd = -1;
+            return false;
+        }
+        // The collector takes the pid from the connection and the build id from the file header, nothing else may
+        // be sent before it
+        if (!send_message(w, w->file_header, LOGGING_FILE_HEADER_SIZE)) {
+            if (w->fd >= 0) close(w->fd);
+            w->fd = -1;
+            return false;
+        }
+    }
+
+    size_t pos = 0;
+    while (pos < w->backlog_fill) {
+        uint32_t size = backlog_frame_size(w, pos);
+        if (!send_message(w, w->backlog + pos + BACKLOG_FRAME_HEADER_SIZE, size)) break;
+        pos += BACKLOG_FRAME_HEADER_SIZE + size;
+    }
+    memmove(w->backlog, w->backlog + pos, w->backlog_fill - pos);
+    w->backlog_fill -= pos;
+    return w->backlog_fill == 0;
+}
+
+// Needs the lock of the writer
+static void socket_writer_send_batch(SocketWriter *w) {
+    if (w->fill == 0) return;
+
+    if (!socket_writer_connect(w) || !send_message(w, w->buffer, w->fill)) {
+        backlog_push(w, w->buffer, w->fill);
+    }
+    w->fill = 0;
+}
+
+// Batches buffered before a fork are sent by the parent only, the child connects on its own so the collector sees
+// its pid, and starts with an empty buffer and backlog
+static void socket_writers_prepare_fork() {
+    pthread_mutex_lock(&WRITERS.lock);
+    for (SocketWriter *w = WRITERS.writers; w != nullptr; w = w->next) {
+        pthread_mutex_lock(&w->lock);
+        socket_writer_send_batch(w);
+    }
+}
+
+static void socket_writers_after_fork_parent() {
+    for (SocketWriter *w = WRITERS.writers; w != nullptr; w = w->next) {
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&WRITERS.lock);
+}
+
+static void socket_writers_after_fork_child() {
+    for (SocketWriter *w = WRITERS.writers; w != nullptr; w = w->next) {
+        if (w->fd >= 0) close(w->fd);
+        w->fd = -1;
+        w->last_connect_ms = 0;
+        w->fill = 0;
+        w->backlog_fill = 0;
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&WRITERS.lock);
+}
+
+SocketWriter *socket_writer_create(const char *path, size_t buffer_size, size_t buffer_count,
+                                   const char *file_header) {
+    if (strlen(path) >= sizeof(((struct sockaddr_un *)nullptr)->sun_path)) return nullptr;
+
+    SocketWriter *w = calloc(1, sizeof *w);
+    if (w == nullptr) return nullptr;
+
+    w->address.sun_family = AF_UNIX;
+    strcpy(w->address.sun_path, path);
+    memcpy(w->file_header, file_header, LOGGING_FILE_HEADER_SIZE);
+    w->fd = -1;
+
+    w->buffer_size = buffer_size < CSL_COLLECTOR_MAX_BATCH_SIZE ? buffer_size : CSL_COLLECTOR_MAX_BATCH_SIZE;
+    w->buffer = malloc(w->buffer_size);
+    w->backlog_capacity = buffer_count * (BACKLOG_FRAME_HEADER_SIZE + w->buffer_size);
+    w->backlog = malloc(w->backlog_capacity);
+    if (w->buffer == nullptr || w->backlog == nullptr) {
+        free(w->buffer);
+        free(w->backlog);
+        free(w);
+        return nullptr;
+    }
+    pthread_mutex_init(&w->lock, nullptr);
+
+    // A collector that is not running yet is not an error, the batches wait in the backlog
+    pthread_mutex_lock(&w->lock);
+    socket_writer_connect(w);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&WRITERS.lock);
+    if (!WRITERS.atfork_installed) {
+        pthread_atfork(socket_writers_prepare_fork, socket_writers_after_fork_parent, socket_writers_after_fork_child);
+        WRITERS.atfork_installed = true;
+    }
+    w->next = WRITERS.writers;
+    WRITERS.writers = w;
+    pthread_mutex_unlock(&WRITERS.lock);
+
+    return w;
+}
+
+void socket_writer_write(SocketWriter *w, const char *data, size_t byte_count) {
+    pthread_mutex_lock(&w->lock);
+
+    if (byte_count > w->buffer_size) {
+        // Larger than a message to the collector can be, the first one is reported right away and the count on close
+        if (w->dropped_records == 0) {
+            fprintf(stderr, "csl: dropped a record of %zu bytes, larger than the batch size of %zu bytes for %s\n",
+                    byte_count, w->buffer_size, w->address.sun_path);
+        }
+        w->dropped_records += 1;
+    } else {
+        if (w->fill + byte_count > w->buffer_size) socket_writer_send_batch(w);
+        memcpy(w->buffer + w->fill, data, byte_count);
+        w->fill += byte_count;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+void socket_writer_flush(SocketWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    socket_writer_send_batch(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void socket_writer_close(SocketWriter *w) {
+    pthread_mutex_lock(&WRITERS.lock);
+    for (SocketWriter **it = &WRITERS.writers; *it != nullptr; it = &(*it)->next) {
+        if (*it == w) {
+            *it = w->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&WRITERS.lock);
+
+    // One last attempt to reach the collector regardless of the reconnect interval, a busy collector gets
+    // RECONNECT_INTERVAL_MS to take the rest
+    pthread_mutex_lock(&w->lock);
+    w->last_connect_ms = 0;
+    socket_writer_send_batch(w);
+    uint64_t deadline = monotonic_ms() + RECONNECT_INTERVAL_MS;
+    while (w->fd >= 0 && w->backlog_fill > 0 && monotonic_ms() < deadline) {
+        struct pollfd pfd = {.fd = w->fd, .events = POLLOUT};
+        poll(&pfd, 1, (int)(deadline - monotonic_ms()));
+        socket_writer_connect(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    size_t backlog_batches = 0;
+    for (size_t pos = 0; pos < w->backlog_fill; pos += BACKLOG_FRAME_HEADER_SIZE + backlog_frame_size(w, pos)) {
+        backlog_batches += 1;
+    }
+    if (w->dropped_batches + backlog_batches > 0) {
+        fprintf(stderr, "csl: the collector at %s was not reachable or too slow, %lu batches of records were lost\n",
+                w->address.sun_path, (unsigned long)(w->dropped_batches + backlog_batches));
+    }
+    if (w->dropped_records > 0) {
+        fprintf(stderr, "csl: dropped %lu records larger than the batch size of %zu bytes\n",
+                (unsigned long)w->dropped_records, w->buffer_size);
+    }
+
+    if (w->fd >= 0) close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    free(w->buffer);
+    free(w->backlog);
+    free(w);
+}
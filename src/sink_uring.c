@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "csl_internal.h"
+
+// O_DIRECT needs offsets, lengths and buffers aligned to the logical block size of the device
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+struct UringWriter {
+    int fd;
+    int ring_fd;
+    bool direct;
+    bool compact;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    size_t buffer_size;
+    size_t buffer_count;
+    char *buffers;
+    // Length and file offset of the write that is in flight per buffer, a length of 0 means the buffer can be filled
+    size_t *in_flight;
+    uint64_t *in_flight_offset;
+
+    size_t current;
+    size_t fill;
+    uint64_t file_offset;
+    // File size without the padding of the last O_DIRECT flush
+    uint64_t logical_size;
+    int error;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static bool uring_map(UringWriter *w, unsigned entries) {
+    struct io_uring_params params = {};
+    w->ring_fd = uring_setup(entries, &params);
+    if (w->ring_fd < 0) return false;
+
+    w->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    w->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (w->cq_ring_size > w->sq_ring_size) w->sq_ring_size = w->cq_ring_size;
+        w->cq_ring_size = w->sq_ring_size;
+    }
+
+    w->sq_ring = mmap(nullptr, w->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      w->ring_fd, IORING_OFF_SQ_RING);
+    if (w->sq_ring == MAP_FAILED) return false;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        w->cq_ring = w->sq_ring;
+    } else {
+        w->cq_ring = mmap(nullptr, w->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          w->ring_fd, IORING_OFF_CQ_RING);
+        if (w->cq_ring == MAP_FAILED) return false;
+    }
+
+    w->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(nullptr, w->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   w->ring_fd, IORING_OFF_SQES);
+    if (w->sqes == MAP_FAILED) return false;
+
+    char *sq = w->sq_ring;
+    w->sq_head = (unsigned *)(sq + params.sq_off.head);
+    w->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    w->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    w->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = w->cq_ring;
+    w->cq_head = (unsigned *)(cq + params.cq_off.head);
+    w->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    w->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+// Handles all available completions, waits for at least min_complete of them
+static void uring_reap(UringWriter *w, unsigned min_complete) {
+    if (min_complete > 0) {
+        while (uring_enter(w->ring_fd, 0, min_complete, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR) {}
+    }
+
+    unsigned head = *w->cq_head;
+    unsigned tail = __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &w->cqes[head & w->cq_mask];
+        size_t index = cqe->user_data;
+        size_t length = w->in_flight[index];
+
+        if (cqe->res < 0) {
+            w->error = -cqe->res;
+        } else if ((size_t)cqe->res < length) {
+            // Short writes are completed synchronously so the file has no holes
+            size_t done = (size_t)cqe->res;
+            const char *rest = w->buffers + index * w->buffer_size + done;
+            if (w->direct || pwrite(w->fd, rest, length - done, (off_t)(w->in_flight_offset[index] + done)) < 0) {
+                w->error = EIO;
+            }
+        }
+        w->in_flight[index] = 0;
+    }
+
+    __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_submit_buffer(UringWriter *w, size_t index, size_t length) {
+    unsigned tail = *w->sq_tail;
+    unsigned slot = tail & w->sq_mask;
+
+    struct io_uring_sqe *sqe = &w->sqes[slot];
+    *sqe = (struct io_uring_sqe) {
+        .opcode = IORING_OP_WRITE_FIXED,
+        .fd = w->fd,
+        .off = w->file_offset,
+        .addr = (uint64_t)(uintptr_t)(w->buffers + index * w->buffer_size),
+        .len = (uint32_t)length,
+        .buf_index = (uint16_t)index,
+        .user_data = index,
+    };
+    w->sq_array[slot] = slot;
+    __atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    w->in_flight[index] = length;
+    w->in_flight_offset[index] = w->file_offset;
+    w->file_offset += length;
+
+    while (uring_enter(w->ring_fd, 1, 0, 0) < 0 && errno == EINTR) {}
+}
+
+UringWriter *uring_writer_create(const char *filename, size_t buffer_size, size_t buffer_count, bool direct,
+                                 bool compact) {
+    UringWriter *w = calloc(1, sizeof *w);
+    if (w == nullptr) return nullptr;
+
+    w->ring_fd = -1;
+    w->direct = direct;
+    w->compact = compact;
+    w->buffer_count = buffer_count;
+    w->buffer_size = (buffer_size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+    w->in_flight = calloc(buffer_count, sizeof(w->in_flight[0]));
+    w->in_flight_offset = calloc(buffer_count, sizeof(w->in_flight_offset[0]));
+
+    if (w->fd < 0 || w->in_flight == nullptr || w->in_flight_offset == nullptr
+        || posix_memalign((void **)&w->buffers, DIRECT_IO_ALIGNMENT, w->buffer_size * buffer_count) != 0
+        || !uring_map(w, (unsigned)buffer_count)) {
+        uring_writer_close(w);
+        return nullptr;
+    }
+
+    struct iovec *iovecs = calloc(buffer_count, sizeof(iovecs[0]));
+    for (size_t i = 0; i < buffer_count && iovecs != nullptr; ++i) {
+        iovecs[i] = (struct iovec) {.iov_base = w->buffers + i * w->buffer_size, .iov_len = w->buffer_size};
+    }
+    int rc = iovecs != nullptr ? uring_register(w->ring_fd, IORING_REGISTER_BUFFERS, iovecs, buffer_count) : -1;
+    free(iovecs);
+    if (rc < 0) {
+        uring_writer_close(w);
+        return nullptr;
+    }
+
+    return w;
+}
+
+// Moves on to the next buffer, producers only wait here if every buffer is in flight
+static void uring_next_buffer(UringWriter *w) {
+    w->current = (w->current + 1) % w->buffer_count;
+    w->fill = 0;
+
+    uring_reap(w, 0);
+    while (w->in_flight[w->current] != 0) {
+        uring_reap(w, 1);
+    }
+}
+
+void uring_writer_write(UringWriter *w, const char *data, size_t byte_count) {
+    while (byte_count > 0) {
+        size_t space = w->buffer_size - w->fill;
+        size_t chunk = byte_count < space ? byte_count : space;
+
+        memcpy(w->buffers + w->current * w->buffer_size + w->fill, data, chunk);
+        w->fill += chunk;
+        data += chunk;
+        byte_count -= chunk;
+
+        // Records may span buffers, the file is a plain byte stream
+        if (w->fill == w->buffer_size) {
+            uring_submit_buffer(w, w->current, w->fill);
+            w->logical_size = w->file_offset;
+            uring_next_buffer(w);
+        }
+    }
+}
+
+// Submits the partially filled buffer, O_DIRECT writes are padded to the block size with a padding record
+void uring_writer_flush(UringWriter *w) {
+    if (w->fill == 0) return;
+
+    uint64_t logical_size = w->file_offset + w->fill;
+
+    if (w->direct) {
+        static const char zeros[DIRECT_IO_ALIGNMENT] = {};
+
+        // Buffers start at a block boundary, the padding record ends at the next one
+        size_t record_size = w->compact ? CSL_COMPACT_PADDING_RECORD_SIZE : CSL_PADDING_RECORD_SIZE;
+        size_t padding = ((w->fill + record_size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1)) - w->fill;
+
+        char record[CSL_PADDING_RECORD_SIZE];
+        char *p = w->compact ? encode_binary_u8(record, CSL_COMPACT_CODE_PADDING) : encode_binary_i32(record, CSL_RECORD_PADDING);
+        encode_binary_u32(p, (uint32_t)(padding - record_size));
+
+        uring_writer_write(w, record, record_size);
+        for (size_t left = padding - record_size; left > 0;) {
+            size_t chunk = left < sizeof zeros ? left : sizeof zeros;
+            uring_writer_write(w, zeros, chunk);
+            left -= chunk;
+        }
+    }
+
+    // The padding may have completed the buffer, which was submitted by uring_writer_write then
+    if (w->fill > 0) {
+        uring_submit_buffer(w, w->current, w->fill);
+        uring_next_buffer(w);
+    }
+    w->logical_size = logical_size;
+}
+
+void uring_writer_close(UringWriter *w) {
+    if (w->ring_fd >= 0 && w->buffers != nullptr) {
+        uring_writer_flush(w);
+        for (size_t i = 0; i < w->buffer_count; ++i) {
+            while (w->in_flight[i] != 0) uring_reap(w, 1);
+        }
+    }
+
+    if (w->error != 0) fprintf(stderr, "csl: io_uring write failed: %s\n", strerror(w->error));
+
+    // The trailing padding of the last O_DIRECT write is not needed anymore
+    if (w->fd >= 0 && w->direct && w->ring_fd >= 0) (void)!ftruncate(w->fd, (off_t)w->logical_size);
+
+    if (w->sqes != nullptr && w->sqes != MAP_FAILED) munmap(w->sqes, w->sqes_size);
+    if (w->cq_ring != nullptr && w->cq_ring != MAP_FAILED && w->cq_ring != w->sq_ring) munmap(w->cq_ring, w->cq_ring_size);
+    if (w->sq_ring != nullptr && w->sq_ring != MAP_FAILED) munmap(w->sq_ring, w->sq_ring_size);
+    if (w->ring_fd >= 0) close(w->ring_fd);
+    if (w->fd >= 0) close(w->fd);
+
+    free(w->buffers);
+    free(w->in_flight);
+    free(w->in_flight_offset);
+    free(w);
+}
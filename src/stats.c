@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "log_printer.h"
+
+// Log-linear histogram: 32 linear sub-buckets per power of two from 2^-32 to 2^32 for each sign, which keeps the
+// relative error of a percentile below 1/32. The buckets are fixed, so histograms are merged by adding the counts.
+// A histogram only allocates the buckets between the smallest and the largest value, which are few for most arguments.
+constexpr int HISTOGRAM_SUB_BITS = 5;
+constexpr int HISTOGRAM_SUB_COUNT = 1 << HISTOGRAM_SUB_BITS;
+constexpr int HISTOGRAM_MIN_EXPONENT = -32;
+constexpr int HISTOGRAM_MAX_EXPONENT = 31;
+constexpr size_t HISTOGRAM_HALF = (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_MIN_EXPONENT + 1) * HISTOGRAM_SUB_COUNT;
+// Negative values below, positive values above the bucket for zero
+constexpr size_t HISTOGRAM_ZERO_BUCKET = HISTOGRAM_HALF;
+// Bounds the rate table to 8 MiB, messages further from the first one are only counted
+constexpr size_t STATS_MAX_INTERVALS = 1 << 20;
+
+static const double PERCENTILES[] = {50.0, 90.0, 99.0, 99.9};
+static const char *PERCENTILE_NAMES[] = {"p50", "p90", "p99", "p999"};
+static_assert(sizeof PERCENTILES / sizeof PERCENTILES[0] == sizeof PERCENTILE_NAMES / sizeof PERCENTILE_NAMES[0]);
+
+typedef struct {
+    uint64_t count;
+    double min;
+    double max;
+    double sum;
+    // Counts of the buckets first_bucket to first_bucket + bucket_count - 1, allocated with the first value,
+    // string arguments are only counted
+    uint64_t *buckets;
+    size_t first_bucket;
+    size_t bucket_count;
+} ArgStats;
+
+typedef struct {
+    const LogHeader *header;
+    int64_t id;
+    uint64_t count;
+    uint32_t first_timestamp;
+    uint32_t last_timestamp;
+    ArgStats args[CSL_MAX_ARG_COUNT];
+} CallsiteStats;
+
+struct StatsCollector {
+    uint32_t interval_ms;
+    uint64_t message_count;
+
+    // Open addressing from the header address to the index in callsites, the size is a power of two
+    size_t slot_count;
+    uint32_t *slots;
+
+    size_t size;
+    size_t capacity;
+    CallsiteStats *callsites;
+
+    bool has_start;
+    uint32_t start_timestamp;
+    size_t interval_count;
+    uint64_t *interval_messages;
+    // Messages beyond STATS_MAX_INTERVALS intervals
+    uint64_t late_messages;
+};
+
+static size_t histogram_bucket(double value) {
+    float magnitude = fabsf((float)value);
+    if (!(magnitude >= 0x1p-32f)) return HISTOGRAM_ZERO_BUCKET;
+
+    uint32_t bits;
+    memcpy(&bits, &magnitude, sizeof bits);
+
+    // The exponent and the leading mantissa bits of a float are its log-linear bucket
+    int exponent = (int)(bits >> 23) - 127;
+    size_t sub = (bits >> (23 - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+    if (exponent > HISTOGRAM_MAX_EXPONENT) {
+        exponent = HISTOGRAM_MAX_EXPONENT;
+        sub = HISTOGRAM_SUB_COUNT - 1;
+    }
+
+    size_t index = (size_t)(exponent - HISTOGRAM_MIN_EXPONENT) * HISTOGRAM_SUB_COUNT + sub;
+    return value < 0 ? HISTOGRAM_ZERO_BUCKET - 1 - index : HISTOGRAM_ZERO_BUCKET + 1 + index;
+}
+
+// Middle of the bucket
+static double histogram_bucket_value(size_t bucket) {
+    if (bucket == HISTOGRAM_ZERO_BUCKET) return 0.0;
+
+    bool negative = bucket < HISTOGRAM_ZERO_BUCKET;
+    size_t index = negative ? HISTOGRAM_ZERO_BUCKET - 1 - bucket : bucket - HISTOGRAM_ZERO_BUCKET - 1;
+
+    int exponent = (int)(index / HISTOGRAM_SUB_COUNT) + HISTOGRAM_MIN_EXPONENT;
+    double sub = (double)(index % HISTOGRAM_SUB_COUNT);
+    double value = ldexp(1.0 + (sub + 0.5) / HISTOGRAM_SUB_COUNT, exponent);
+    return negative ? -value : value;
+}
+
+static double arg_stats_percentile(const ArgStats *arg, double percentile) {
+    uint64_t rank = (uint64_t)ceil(percentile / 100.0 * (double)arg->count);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < arg->bucket_count; ++i) {
+        seen += arg->buckets[i];
+        if (seen >= rank) {
+            // The exact extremes are known, so the estimate never leaves them
+            double value = histogram_bucket_value(arg->first_bucket + i);
+            if (value < arg->min) return arg->min;
+            if (value > arg->max) return arg->max;
+            return value;
+        }
+    }
+    return arg->max;
+}
+
+// Widens the allocated range of buckets to bucket if needed
+static void histogram_count(ArgStats *arg, size_t bucket) {
+    size_t end = arg->first_bucket + arg->bucket_count;
+    if (arg->buckets == nullptr || bucket < arg->first_bucket || bucket >= end) {
+        size_t first = arg->buckets == nullptr || bucket < arg->first_bucket ? bucket : arg->first_bucket;
+        if (arg->buckets == nullptr || bucket >= end) end = bucket + 1;
+
+        uint64_t *buckets = calloc(end - first, sizeof(buckets[0]));
+        if (buckets == nullptr) return;
+        if (arg->buckets != nullptr) {
+            memcpy(buckets + (arg->first_bucket - first), arg->buckets, arg->bucket_count * sizeof(buckets[0]));
+            free(arg->buckets);
+        }
+        arg->buckets = buckets;
+        arg->first_bucket = first;
+        arg->bucket_count = end - first;
+    }
+    arg->buckets[bucket - arg->first_bucket] += 1;
+}
+
+static void arg_stats_add(ArgStats *arg, double value) {
+    // NaN and infinities have no place in the histogram and would break the JSON output
+    if (!isfinite(value)) return;
+
+    if (arg->count == 0) {
+        arg->min = value;
+        arg->max = value;
+    }
+    if (value < arg->min) arg->min = value;
+    if (value > arg->max) arg->max = value;
+    arg->sum += value;
+    arg->count += 1;
+
+    histogram_count(arg, histogram_bucket(value));
+}
+
+static size_t hash_header(const LogHeader *header) {
+    uint64_t h = (uint64_t)(uintptr_t)header;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static void stats_rehash(StatsCollector *stats, size_t slot_count) {
+    free(stats->slots);
+    stats->slot_count = slot_count;
+    stats->slots = malloc(slot_count * sizeof(stats->slots[0]));
+    memset(stats->slots, 0xff, slot_count * sizeof(stats->slots[0]));
+
+    for (uint32_t i = 0; i < stats->size; ++i) {
+        size_t slot = hash_header(stats->callsites[i].header) & (slot_count - 1);
+        while (stats->slots[slot] != UINT32_MAX) slot = (slot + 1) & (slot_count - 1);
+        stats->slots[slot] = i;
+    }
+}
+
+static CallsiteStats *stats_find_callsite(StatsCollector *stats, const LogHeader *header, int64_t id) {
+    size_t slot = hash_header(header) & (stats->slot_count - 1);
+    for (; stats->slots[slot] != UINT32_MAX; slot = (slot + 1) & (stats->slot_count - 1)) {
+        CallsiteStats *callsite = &stats->callsites[stats->slots[slot]];
+        if (callsite->header == header) return callsite;
+    }
+
+    if (stats->size == stats->capacity) {
+        stats->capacity *= 2;
+        stats->callsites = realloc(stats->callsites, stats->capacity * sizeof(stats->callsites[0]));
+    }
+    stats->callsites[stats->size] = (CallsiteStats) {.header = header, .id = id};
+    stats->slots[slot] = (uint32_t)stats->size;
+    stats->size += 1;
+
+    // Keeps the table at most half full
+    if (2 * stats->size > stats->slot_count) stats_rehash(stats, 2 * stats->slot_count);
+    return &stats->callsites[stats->size - 1];
+}
+
+StatsCollector *stats_create(uint32_t interval_ms) {
+    StatsCollector *stats = calloc(1, sizeof *stats);
+    stats->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+    stats->capacity = 64;
+    stats->callsites = malloc(stats->capacity * sizeof(stats->callsites[0]));
+    stats_rehash(stats, 128);
+    return stats;
+}
+
+void stats_free(StatsCollector *stats) {
+    for (size_t i = 0; i < stats->size; ++i) {
+        for (size_t j = 0; j < CSL_MAX_ARG_COUNT; ++j) {
+            free(stats->callsites[i].args[j].buckets);
+        }
+    }
+    free(stats->callsites);
+    free(stats->slots);
+    free(stats->interval_messages);
+    free(stats);
+}
+
+static void stats_count_interval(StatsCollector *stats, uint32_t timestamp) {
+    if (!stats->has_start) {
+        stats->has_start = true;
+        stats->start_timestamp = timestamp;
+    }
+
+    // Records older than the first one (unmerged batches of other processes) are counted in the first interval
+    int32_t offset = (int32_t)(timestamp - stats->start_timestamp);
+    size_t interval = offset > 0 ? (size_t)offset / stats->interval_ms : 0;
+    if (interval >= STATS_MAX_INTERVALS) {
+        stats->late_messages += 1;
+        return;
+    }
+
+    if (interval >= stats->interval_count) {
+        size_t count = stats->interval_count == 0 ? 64 : stats->interval_count;
+        while (count <= interval) count *= 2;
+        if (count > STATS_MAX_INTERVALS) count = STATS_MAX_INTERVALS;
+        uint64_t *intervals = realloc(stats->interval_messages, count * sizeof(intervals[0]));
+        if (intervals == nullptr) return;
+        memset(intervals + stats->interval_count, 0, (count - stats->interval_count) * sizeof(intervals[0]));
+        stats->interval_messages = intervals;
+        stats->interval_count = count;
+    }
+    stats->interval_messages[interval] += 1;
+}
+
+void stats_add(StatsCollector *stats, const LogHeader *header, int64_t id, uint32_t timestamp,
+               const LoggingValueU *values) {
+    CallsiteStats *callsite = stats_find_callsite(stats, header, id);
+    if (callsite->count == 0) callsite->first_timestamp = timestamp;
+    callsite->last_timestamp = timestamp;
+    callsite->count += 1;
+    stats->message_count += 1;
+    stats_count_interval(stats, timestamp);
+
+    for (size_t i = 0; i < header->arg_count; ++i) {
+        ArgStats *arg = &callsite->args[i];
+        switch (header->types[i]) {
+            case TYPE_U8:      arg_stats_add(arg, values[i].val_uint8); break;
+            case TYPE_U32:     arg_stats_add(arg, values[i].val_uint); break;
+            case TYPE_I32:     arg_stats_add(arg, values[i].val_int); break;
+            case TYPE_F32:     arg_stats_add(arg, values[i].val_float); break;
+            case TYPE_CSTRING: arg->count += 1; break;
+            // Every element of a numeric array is a value, blobs are only counted
+            case TYPE_U8_ARRAY:
+            case TYPE_U32_ARRAY:
+            case TYPE_I32_ARRAY:
+            case TYPE_F32_ARRAY:
+                for (size_t j = 0; j < values[i].val_array.count; ++j) {
+                    LoggingValueU element = logging_array_element(header->types[i], values[i].val_array, j);
+                    switch (data_type_element(header->types[i])) {
+                        case TYPE_U8:  arg_stats_add(arg, element.val_uint8); break;
+                        case TYPE_U32: arg_stats_add(arg, element.val_uint); break;
+                        case TYPE_I32: arg_stats_add(arg, element.val_int); break;
+                        case TYPE_F32: arg_stats_add(arg, element.val_float); break;
+                        default:
+                            unreachable();
+                    }
+                }
+                break;
+            case TYPE_BLOB:    arg->count += 1; break;
+            case TYPE_COUNT:
+                unreachable();
+        }
+    }
+}
+
+// Number of intervals up to the last one with a message
+static size_t stats_used_intervals(const StatsCollector *stats) {
+    size_t used = stats->interval_count;
+    while (used > 0 && stats->interval_messages[used - 1] == 0) --used;
+    return used;
+}
+
+void stats_write_report(FILE *f, const StatsCollector *stats) {
+    fprintf(f, "%lu messages from %zu callsites\n\n", (unsigned long)stats->message_count, stats->size);
+
+    for (size_t i = 0; i < stats->size; ++i) {
+        const CallsiteStats *callsite = &stats->callsites[i];
+        const LogHeader *h = callsite->header;
+
+        fprintf(f, "[%c] %s:%d (id %lld) \"%s\"\n", LOG_LEVEL_NAMES_SHORT[h->level], h->filename.data, h->line,
+                (long long)callsite->id, h->fmt_str.data);
+        fprintf(f, "    count %lu, from %u to %u\n", (unsigned long)callsite->count, callsite->first_timestamp,
+                callsite->last_timestamp);
+
+        for (size_t j = 0; j < h->arg_count; ++j) {
+            const ArgStats *arg = &callsite->args[j];
+            fprintf(f, "    arg %zu (%s): count %lu", j, DATA_TYPE_NAMES[h->types[j]].data, (unsigned long)arg->count);
+            if (h->types[j] != TYPE_CSTRING && arg->buckets != nullptr) {
+                fprintf(f, ", min %g, max %g, mean %g", arg->min, arg->max, arg->sum / (double)arg->count);
+                for (size_t p = 0; p < sizeof PERCENTILES / sizeof PERCENTILES[0]; ++p) {
+                    fprintf(f, ", %s %g", PERCENTILE_NAMES[p], arg_stats_percentile(arg, PERCENTILES[p]));
+                }
+            }
+            fputc('\n', f);
+        }
+    }
+
+    fprintf(f, "\nMessages per %u ms:\n", stats->interval_ms);
+    for (size_t i = 0; i < stats_used_intervals(stats); ++i) {
+        fprintf(f, "  %10u %lu\n", stats->start_timestamp + (uint32_t)(i * stats->interval_ms),
+                (unsigned long)stats->interval_messages[i]);
+    }
+    if (stats->late_messages > 0) {
+        fprintf(f, "  %lu messages after the last of %zu intervals\n", (unsigned long)stats->late_messages,
+                STATS_MAX_INTERVALS);
+    }
+}
+
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    escape_write(f, ESCAPE_JSON, s, strlen(s));
+    fputc('"', f);
+}
+
+void stats_write_json(FILE *f, const StatsCollector *stats) {
+    fprintf(f, "{\n");
+    fprintf(f, "  \"messages\": %lu,\n", (unsigned long)stats->message_count);
+    fprintf(f, "  \"callsites\": [\n");
+
+    for (size_t i = 0; i < stats->size; ++i) {
+        const CallsiteStats *callsite = &stats->callsites[i];
+        const LogHeader *h = callsite->header;
+
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"id\": %lld,\n", (long long)callsite->id);
+        fprintf(f, "      \"fmt_str\": ");
+        write_json_string(f, h->fmt_str.data);
+        fprintf(f, ",\n      \"filename\": ");
+        write_json_string(f, h->filename.data);
+        fprintf(f, ",\n      \"line\": %d,\n", h->line);
+        fprintf(f, "      \"level\": \"%s\",\n", LOG_LEVEL_NAMES[h->level].data);
+        fprintf(f, "      \"count\": %lu,\n", (unsigned long)callsite->count);
+        fprintf(f, "      \"first_timestamp\": %u,\n", callsite->first_timestamp);
+        fprintf(f, "      \"last_timestamp\": %u,\n", callsite->last_timestamp);
+        fprintf(f, "      \"args\": [");
+
+        for (size_t j = 0; j < h->arg_count; ++j) {
+            const ArgStats *arg = &callsite->args[j];
+            fprintf(f, "%s\n        {\"type\": \"%s\", \"count\": %lu", j == 0 ? "" : ",",
+                    DATA_TYPE_NAMES[h->types[j]].data, (unsigned long)arg->count);
+            if (h->types[j] != TYPE_CSTRING && arg->buckets != nullptr) {
+                fprintf(f, ", \"min\": %.17g, \"max\": %.17g, \"mean\": %.17g", arg->min, arg->max,
+                        arg->sum / (double)arg->count);
+                for (size_t p = 0; p < sizeof PERCENTILES / sizeof PERCENTILES[0]; ++p) {
+                    fprintf(f, ", \"%s\": %.17g", PERCENTILE_NAMES[p], arg_stats_percentile(arg, PERCENTILES[p]));
+                }
+            }
+            fputc('}', f);
+        }
+
+        fprintf(f, "%s]\n", h->arg_count > 0 ? "\n      " : "");
+        fprintf(f, "    }%s\n", i + 1 < stats->size ? "," : "");
+    }
+
+    fprintf(f, "  ],\n");
+    fprintf(f, "  \"rates\": {\n");
+    fprintf(f, "    \"start_timestamp\": %u,\n", stats->start_timestamp);
+    fprintf(f, "    \"interval_ms\": %u,\n", stats->interval_ms);
+    fprintf(f, "    \"messages\": [");
+    size_t used = stats_used_intervals(stats);
+    for (size_t i = 0; i < used; ++i) {
+        fprintf(f, "%s%lu", i == 0 ? "" : ", ", (unsigned long)stats->interval_messages[i]);
+    }
+    fprintf(f, "],\n");
+    fprintf(f, "    \"late_messages\": %lu\n", (unsigned long)stats->late_messages);
+    fprintf(f, "  }\n");
+    fprintf(f, "}\n");
+}
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "csl.h"
 
@@ -17,42 +18,156 @@ const char* args_get_value(const char *name, int argc, char **argv) {
     return argv[pos + 1];
 }
 
+int args_get_values(const char *name, int argc, char **argv, const char **values) {
+    int count = 0;
+    for (int i = 1; i < argc - 1; ++i) {
+        if (strcmp(name, argv[i]) == 0) values[count++] = argv[++i];
+    }
+    return count;
+}
+
 size_t read_binary_u8(uint8_t *v,   FILE *f)    { return fread(v, 1, sizeof *v,f); }
 size_t read_binary_i32(int32_t *v,  FILE *f)    { return fread(v, 1, sizeof *v,f); }
 size_t read_binary_u32(uint32_t *v, FILE *f)    { return fread(v, 1, sizeof *v,f); }
+size_t read_binary_u64(uint64_t *v, FILE *f)    { return fread(v, 1, sizeof *v,f); }
 size_t read_binary_f32(float *v,    FILE *f)    { return fread(v, 1, sizeof *v,f); }
 
-size_t read_binary_cstring(char ** v, FILE *f) {
-    uint32_t length;
-    size_t read = read_binary_u32( &length, f);
+// LEB128, 7 bits per byte starting with the lowest ones, the high bit marks that another byte follows
+size_t read_binary_varint_u32(uint32_t *v, FILE *f) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 5; ++i) {
+        int c = getc(f);
+        if (c == EOF) return 0;
+        value |= (uint32_t)(c & 0x7f) << (7 * i);
+        if ((c & 0x80) == 0) {
+            *v = value;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+size_t read_binary_varint_i32(int32_t *v, FILE *f) {
+    uint32_t zigzag;
+    size_t read = read_binary_varint_u32(&zigzag, f);
+    *v = (int32_t)((zigzag >> 1) ^ -(zigzag & 1));
+    return read;
+}
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) char data[];
+};
+
+constexpr size_t ARENA_BLOCK_SIZE = 64 << 10;
 
-    if(read == 0) {
-        *v = nullptr;
-        return 0;
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+    // Blocks stay in the chain after a reset, so a steady state needs no allocation at all
+    ArenaBlock **link = arena->current != nullptr ? &arena->current : &arena->first;
+    while (*link != nullptr && (*link)->used + size > (*link)->size) link = &(*link)->next;
+
+    if (*link == nullptr) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = malloc(sizeof *block + block_size);
+        if (block == nullptr) return nullptr;
+        *block = (ArenaBlock) {.size = block_size};
+        *link = block;
     }
 
-    *v = malloc(length);
+    arena->current = *link;
+    void *p = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return p;
+}
 
-    // TODO: handle partial reads
-    read += fread(*v, 1, length, f);
+void arena_reset(Arena *arena) {
+    for (ArenaBlock *block = arena->first; block != nullptr; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+}
 
-    return read;
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->first;
+    while (block != nullptr) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    *arena = (Arena) {};
+}
+
+// A length from a corrupt log must not allocate more than the rest of the stream. Only large lengths are checked,
+// the seeks drop the buffer of the stream, and a small allocation does no harm.
+static bool stream_has_bytes(FILE *f, size_t byte_count) {
+    if (byte_count <= ARENA_BLOCK_SIZE) return true;
+
+    long pos = ftell(f);
+    if (pos < 0 || fseek(f, 0, SEEK_END) != 0) return false;
+    long end = ftell(f);
+    fseek(f, pos, SEEK_SET);
+    return end >= pos && (size_t)(end - pos) >= byte_count;
 }
 
-size_t read_binary_logging_value(LoggingValueU *v, DataType type, FILE* f) {
+// Returns 0 if the string is incomplete, like the last record of a log that is still written
+size_t read_binary_cstring(char ** v, Arena *strings, FILE *f) {
+    *v = nullptr;
+
+    uint32_t length;
+    if (read_binary_u32(&length, f) != sizeof length) return 0;
+
+    if (!stream_has_bytes(f, length)) return 0;
+
+    // length includes the terminating zero, it is set again in case the log is corrupted
+    char *s = arena_alloc(strings, (size_t)length + 1);
+    if (s == nullptr) return 0;
+
+    if (fread(s, 1, length, f) != length) return 0;
+    s[length > 0 ? length - 1 : 0] = '\0';
+
+    *v = s;
+    return sizeof length + length;
+}
+
+size_t read_binary_array(LoggingArray *v, size_t element_size, Arena *strings, FILE *f) {
+    *v = (LoggingArray) {};
+
+    uint32_t count;
+    if (read_binary_u32(&count, f) != sizeof count) return 0;
+
+    // The elements are copied into the arena, which keeps them aligned for the element type
+    size_t byte_count = (size_t)count * element_size;
+    if (!stream_has_bytes(f, byte_count)) return 0;
+    void *data = arena_alloc(strings, byte_count > 0 ? byte_count : 1);
+    if (data == nullptr) return 0;
+    if (fread(data, 1, byte_count, f) != byte_count) return 0;
+
+    *v = (LoggingArray) {.data = data, .count = count};
+    return sizeof count + byte_count;
+}
+
+size_t read_binary_logging_value(LoggingValueU *v, DataType type, Arena *strings, FILE* f) {
     switch (type) {
         case TYPE_U8:
-            return read_binary_u8(&v->val_uint8, f);
+            return read_binary_u8(&v->val_uint8, f) == sizeof v->val_uint8 ? sizeof v->val_uint8 : 0;
         case TYPE_U32:
-            return read_binary_u32(&v->val_uint, f);
+            return read_binary_u32(&v->val_uint, f) == sizeof v->val_uint ? sizeof v->val_uint : 0;
         case TYPE_I32:
-            return read_binary_i32(&v->val_int, f);
+            return read_binary_i32(&v->val_int, f) == sizeof v->val_int ? sizeof v->val_int : 0;
         case TYPE_F32:
-            return read_binary_f32(&v->val_float, f);
+            return read_binary_f32(&v->val_float, f) == sizeof v->val_float ? sizeof v->val_float : 0;
         case TYPE_CSTRING:
-            //NOTE: It would be better to read the string into some kine of string pool
-            // instead of this unsafe casting here
-            return read_binary_cstring((char **)&v->val_cstring, f);
+            return read_binary_cstring((char **)&v->val_cstring, strings, f);
+        case TYPE_U8_ARRAY:
+        case TYPE_U32_ARRAY:
+        case TYPE_I32_ARRAY:
+        case TYPE_F32_ARRAY:
+        case TYPE_BLOB:
+            return read_binary_array(&v->val_array, DATA_TYPE_ELEMENT_SIZES[type], strings, f);
         case TYPE_COUNT:
             unreachable();
     }
@@ -70,15 +185,68 @@ void write_binary_cstring(const char * v, FILE *f) {
     fwrite(v, sizeof(char), length, f);
 }
 
+char *encode_binary_u8(char *p, uint8_t v)     { memcpy(p, &v, sizeof v); return p + sizeof v; }
+char *encode_binary_i32(char *p, int32_t v)    { memcpy(p, &v, sizeof v); return p + sizeof v; }
+char *encode_binary_u32(char *p, uint32_t v)   { memcpy(p, &v, sizeof v); return p + sizeof v; }
+char *encode_binary_u64(char *p, uint64_t v)   { memcpy(p, &v, sizeof v); return p + sizeof v; }
+char *encode_binary_f32(char *p, float v)      { memcpy(p, &v, sizeof v); return p + sizeof v; }
+
+char *encode_binary_varint_u32(char *p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+// Zig-zag maps small negative numbers to small unsigned ones: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+char *encode_binary_varint_i32(char *p, int32_t v) {
+    return encode_binary_varint_u32(p, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+// length includes the terminating zero, the same as write_binary_cstring
+char *encode_binary_cstring(char *p, const char *v, uint32_t length) {
+    p = encode_binary_u32(p, length);
+    memcpy(p, v, length);
+    return p + length;
+}
+
+// The elements are copied as they are, byte_count is count times the element size
+char *encode_binary_array(char *p, LoggingArray v, uint32_t byte_count) {
+    p = encode_binary_u32(p, v.count);
+    if (byte_count > 0) memcpy(p, v.data, byte_count);
+    return p + byte_count;
+}
+
 const StringView DATA_TYPE_NAMES[] = {
         SV("u8"),
         SV("u32"),
         SV("i32"),
         SV("f32"),
         SV("cstring"),
+        SV("u8[]"),
+        SV("u32[]"),
+        SV("i32[]"),
+        SV("f32[]"),
+        SV("blob"),
 };
 static_assert((sizeof DATA_TYPE_NAMES) == sizeof(DATA_TYPE_NAMES[0]) * TYPE_COUNT);
 
+const uint8_t DATA_TYPE_ELEMENT_SIZES[] = {
+        sizeof(uint8_t),
+        sizeof(uint32_t),
+        sizeof(int32_t),
+        sizeof(float),
+        0,
+        sizeof(uint8_t),
+        sizeof(uint32_t),
+        sizeof(int32_t),
+        sizeof(float),
+        1,
+};
+static_assert(sizeof DATA_TYPE_ELEMENT_SIZES == sizeof(DATA_TYPE_ELEMENT_SIZES[0]) * TYPE_COUNT);
+
 const StringView LOG_LEVEL_NAMES[] = {
         SV("TRACE"),
         SV("DEBUG"),